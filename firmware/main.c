@@ -2,6 +2,7 @@
 #include <avr/io.h>
 #include <avr/wdt.h>
 #include <avr/interrupt.h>
+#include <avr/eeprom.h>
 #include <util/delay.h>
 
 #include <avr/pgmspace.h>   /* required by usbdrv.h */
@@ -10,18 +11,6 @@
 #include "requests.h"
 #include "crc8.h"
 
-/* RA+  ... PD3
-   RA-  ... PD5
-   DEC+ ... PD6
-   DEC- ... PD4 */
-
-#define GUIDE_RA_PLUS   _BV(3)
-#define GUIDE_RA_MINUS  _BV(5)
-#define GUIDE_DEC_PLUS  _BV(1)
-#define GUIDE_DEC_MINUS _BV(4)
-
-#define GUIDE_MASK (GUIDE_RA_PLUS | GUIDE_RA_MINUS | GUIDE_DEC_PLUS | GUIDE_DEC_MINUS)
-
 /* DS1820 commands */
 #define DS1820_SKIP_ROM        0xCC
 #define DS1820_CONVERT_T       0x44
@@ -35,20 +24,37 @@
 #define FAN1_BIT _BV(3)
 #define FAN2_BIT _BV(4)
 
+/* an unplugged sensor only gets a reset pulse this often, frames */
+#define PROBE_FRAMES 3000
+
 enum {
 	IDLE,
 	CONVERTING,
 	READING,
 };
 
+/* A reply longer than 8 bytes goes out over several usbPoll() calls, so
+   THERMAL_RQ_TEMPS sends a copy made in usbFunctionSetup() (reply below)
+   and conversions keep going into sample meanwhile. One copy for all four
+   sensors, there's no RAM for a second buffer each on a 4313.
+
+   Each conversion adds to the running sum, until the host has read it
+   (restart). sample.now is only filled in the copy.
+
+   A sensor that misses a reset pulse is absent and is left out of the
+   round robin, except for a re-probe every PROBE_FRAMES. */
 struct ds1820 {
 	uint8_t pin;
 	uint8_t state;
 
-	/* LSB, MSB, COUNT_REMAIN, COUNT_PER_C */
-	/* FIXME: the 2 byte padding in this struct gives me much shorter code
-	   (202 bytes at some point!) */
-	uint8_t data[6];
+	uint8_t absent;
+	uint16_t probe;
+
+	uint8_t restart;
+	struct thermal_sample sample;
+
+	/* last conversion, 1/16 C */
+	int16_t t;
 };
 
 /* T1..T4 are on PB */
@@ -60,6 +66,84 @@ struct ds1820 sensors[4] = {
 };
 
 struct ds1820 *sensor;
+uint8_t cur;
+
+/* dew heater PI loops, one per PWM channel */
+static struct thermal_heater heaters[2];
+
+/* max_gap goes out in the first packet, which usbPoll() builds right
+   after usbFunctionSetup(), so the main loop can clear it once the
+   request has been seen. */
+static struct thermal_status status;
+static uint8_t status_read;
+
+/* bumped at every reset, so the host can tell one happened */
+static uint16_t EEMEM boots_ee;
+
+/* 1 ms USB frame clock, extended from the 8 bit usbSofCount. Needs a
+   clock_update() at least every 255 ms; the main loop and the 1-Wire
+   code call it at every 1-Wire byte or half reset pulse, 480 us apart
+   plus interrupts. */
+static uint16_t frames;
+static uint8_t last_sof;
+
+/* device timed guide pulses, frames left per axis. The outputs go on in
+   usbFunctionSetup(), somewhere in a frame, and off at the first
+   clock_update() after the last frame boundary, some 0.6 ms later at
+   worst. A scratchpad read takes 6 ms, too long to wait for the main
+   loop. */
+static uint16_t pulse_left[2];
+#define PULSE_MASK(axis) ((axis) ? GUIDE_RA_MASK : GUIDE_DEC_MASK)
+
+/* what goes out of usbFunctionSetup() that isn't sent live */
+static union {
+	uint16_t echo[2];
+	struct thermal_sample sample;
+	struct thermal_version version;
+} reply;
+
+static void clock_update()
+{
+	uint8_t sof = usbSofCount;
+	uint8_t n = sof - last_sof;
+	uint8_t i;
+
+	frames += n;
+	last_sof = sof;
+
+	for (i = 0; i < 2; i++) {
+		if (!pulse_left[i])
+			continue;
+
+		if (pulse_left[i] <= n) {
+			pulse_left[i] = 0;
+			PORTD &= ~PULSE_MASK(i);
+		} else {
+			pulse_left[i] -= n;
+		}
+	}
+}
+
+static void heater_set(uint8_t ch, uint16_t out)
+{
+	if (ch)
+		OCR1B = out;
+	else
+		OCR1A = out;
+}
+
+/* A loop that loses its sensor or its reference switches the channel off
+   until both answer again, rather than hold what it was putting out. */
+static void heater_lost(struct thermal_heater *h, uint8_t ch, uint8_t id)
+{
+	if (!(h->cfg & HEATER_ENABLE) || (HEATER_SENSOR(h->cfg) != id && HEATER_REF(h->cfg) != id))
+		return;
+
+	h->flags |= HEATER_LOST;
+	h->integ = 0;
+	h->out = 0;
+	heater_set(ch, 0);
+}
 
 /* FIXME: can't disable interrupts, usb will be upset. Trust the CRC */
 uint8_t ds1820_reset()
@@ -70,6 +154,7 @@ uint8_t ds1820_reset()
 	T_PORT &= ~pin;
 	T_DDR |= pin;
 	_delay_us (480);
+	clock_update();
 
 	//cli();
 	T_DDR &= ~pin;
@@ -80,6 +165,19 @@ uint8_t ds1820_reset()
 	_delay_us( 480 - 66);
 	if ((T_PIN & pin) == 0)
 		err = 1;
+	clock_update();
+
+	if (err) {
+		status.reset_err[cur]++;
+		status.present &= ~_BV(cur);
+		sensor->absent = 1;
+		sensor->probe = frames;
+		heater_lost(&heaters[0], 0, cur);
+		heater_lost(&heaters[1], 1, cur);
+	} else {
+		status.present |= _BV(cur);
+		sensor->absent = 0;
+	}
 
 	return err;
 }
@@ -109,6 +207,8 @@ uint8_t ds1820_bitio(uint8_t b)
 uint8_t ds1820_write (uint8_t val)
 {
 	uint8_t i = 8, j;
+
+	clock_update();
 	do {
 		j = ds1820_bitio (val & 1);
 		val >>= 1;
@@ -124,9 +224,55 @@ uint8_t ds1820_read ()
 	return ds1820_write (0xFF);
 }
 
+/* Runs whenever the controlled sensor completes a conversion. Error in
+   1/16 C, output = kp * 64 * error + integ, integ += ki * 4 * error,
+   both clamped to the PWM range. The integrator holds while the output
+   is saturated in the direction of the error. */
+static void heater_update(struct thermal_heater *h, uint8_t ch)
+{
+	struct ds1820 *ref = &sensors[HEATER_REF(h->cfg)];
+	int16_t e;
+	int32_t out, integ;
+
+	if (!(h->cfg & HEATER_ENABLE) || HEATER_SENSOR(h->cfg) != cur)
+		return;
+
+	/* no reference yet, or it's gone */
+	if (ref->sample.seq == 0 || ref->absent)
+		return;
+
+	e = ref->t + h->offset - sensor->t;
+	if (e > 1023)
+		e = 1023;
+	if (e < -1023)
+		e = -1023;
+	h->error = e;
+
+	out = (int32_t) h->kp * 64 * e + h->integ;
+	if (out > 0xFFFF)
+		out = 0xFFFF;
+	if (out < 0)
+		out = 0;
+
+	if (!((out == 0xFFFF && e > 0) || (out == 0 && e < 0))) {
+		integ = (int32_t) h->ki * 4 * e + h->integ;
+		if (integ > 0xFFFF)
+			integ = 0xFFFF;
+		if (integ < 0)
+			integ = 0;
+		h->integ = integ;
+	}
+
+	h->flags &= ~HEATER_LOST;
+	h->out = out;
+	heater_set(ch, out);
+}
+
 static uint8_t ds1820_read_scratchpad()
 {
 	static uint8_t scratchpad[9];
+	struct thermal_sample *sample = &sensor->sample;
+	int16_t t;
 	int i;
 
 	if (ds1820_reset())
@@ -138,13 +284,36 @@ static uint8_t ds1820_read_scratchpad()
 	for (i = 0; i < 9; i++)
 		scratchpad[i] = ds1820_read();
 
-	if (crc8(scratchpad, 9))
+	if (crc8(scratchpad, 9)) {
+		status.crc_err[cur]++;
 		return 0;
+	}
+
+	/* 1/16 C: TEMP_READ with the half degree bit dropped, - 0.25,
+	   + (COUNT_PER_C - COUNT_REMAIN) / COUNT_PER_C, and COUNT_PER_C
+	   is hardwired to 16 */
+	t = (int16_t) (((scratchpad[1] << 8) | scratchpad[0]) & ~1) * 8;
+	t += 16 - 4 - scratchpad[6];
+
+	if (sensor->restart || sample->count == 255) {
+		sensor->restart = 0;
+		sample->sum = t;
+		sample->count = 1;
+	} else {
+		sample->sum += t;
+		sample->count++;
+	}
+
+	/* 0 is reserved for "never converted" */
+	if (++sample->seq == 0)
+		sample->seq = 1;
+	sample->stamp = frames;
+
+	sensor->t = t;
+	status.conversions++;
 
-	sensor->data[0] = scratchpad[0];
-	sensor->data[1] = scratchpad[1];
-	sensor->data[2] = scratchpad[6];
-	sensor->data[3] = scratchpad[7];
+	heater_update(&heaters[0], 0);
+	heater_update(&heaters[1], 1);
 
 	return 1;
 }
@@ -152,7 +321,7 @@ static uint8_t ds1820_read_scratchpad()
 static uint8_t ds1820_convert()
 {
 	if (ds1820_reset())
-		return 1;
+		return 0;
 
 	ds1820_write (DS1820_SKIP_ROM);
 	ds1820_write (DS1820_CONVERT_T);
@@ -172,20 +341,79 @@ usbMsgLen_t usbFunctionSetup(uchar *data)
 {
 	usbRequest_t *rq = (usbRequest_t *) data;
 	uint8_t val = rq->wValue.bytes[0];
+	struct ds1820 *ds;
+	struct thermal_heater *h;
+	uint8_t axis;
 
 	switch (rq->bRequest) {
-	case THERMAL_RQ_TEMPS:
-		usbMsgPtr = sensors[val & 0x03].data;
+	case THERMAL_RQ_ECHO:
+		reply.echo[0] = rq->wValue.word;
+		reply.echo[1] = rq->wIndex.word;
+		usbMsgPtr = (uchar *) reply.echo;
 		return 4;
 
+	case THERMAL_RQ_TEMPS:
+		ds = &sensors[val & 0x03];
+		reply.sample = ds->sample;
+		reply.sample.now = frames;
+		ds->restart = 1;
+		usbMsgPtr = (uchar *) &reply.sample;
+		return sizeof(struct thermal_sample);
+
+	case THERMAL_RQ_STATUS:
+		status_read = 1;
+		usbMsgPtr = (uchar *) &status;
+		return sizeof(status);
+
+	case THERMAL_RQ_VERSION:
+		reply.version.version = THERMAL_PROTOCOL_VERSION;
+		reply.version.pad = 0;
+		reply.version.caps = THERMAL_CAPS;
+		usbMsgPtr = (uchar *) &reply.version;
+		return sizeof(struct thermal_version);
+
 	case THERMAL_RQ_GUIDE:
+		pulse_left[0] = pulse_left[1] = 0;
 		PORTD = (PORTD & ~GUIDE_MASK) | (val & GUIDE_MASK);
 		return 0;
 
+	case THERMAL_RQ_PULSE:
+		axis = rq->wValue.bytes[1] & 0x01;
+		if (!rq->wIndex.word)
+			val = 0;
+		PORTD = (PORTD & ~PULSE_MASK(axis)) | (val & PULSE_MASK(axis));
+		pulse_left[axis] = (val & PULSE_MASK(axis)) ? rq->wIndex.word : 0;
+		return 0;
+
 	case THERMAL_RQ_FANS:
-		OCR1A = rq->wValue.word;
-		OCR1B = rq->wIndex.word;
+		/* channels under PI control ignore manual settings */
+		if (!(heaters[0].cfg & HEATER_ENABLE))
+			OCR1A = rq->wValue.word;
+		if (!(heaters[1].cfg & HEATER_ENABLE))
+			OCR1B = rq->wIndex.word;
+		break;
+
+	case THERMAL_RQ_HEATER:
+		h = &heaters[HEATER_CHANNEL(val)];
+		/* bumpless start from the current duty */
+		if ((val & HEATER_ENABLE) && !(h->cfg & HEATER_ENABLE))
+			h->integ = HEATER_CHANNEL(val) ? OCR1B : OCR1A;
+		h->cfg = val;
+		h->flags = 0;
+		h->offset = rq->wIndex.word;
+		if (sensors[HEATER_SENSOR(val)].absent || sensors[HEATER_REF(val)].absent)
+			heater_lost(h, HEATER_CHANNEL(val), HEATER_SENSOR(val));
 		break;
+
+	case THERMAL_RQ_HEATER_GAINS:
+		h = &heaters[rq->wIndex.bytes[0] & 0x01];
+		h->kp = val;
+		h->ki = rq->wValue.bytes[1];
+		break;
+
+	case THERMAL_RQ_HEATER_STATUS:
+		usbMsgPtr = (uchar *) &heaters[val & 0x01];
+		return sizeof(struct thermal_heater);
 	}
 
 	return 0;
@@ -196,7 +424,20 @@ usbMsgLen_t usbFunctionSetup(uchar *data)
 
 int main(void)
 {
-	uint8_t   i;
+	uint16_t  loops = 0, loop_mark = 0;
+	uint16_t  poll_mark, poll_frames, gap;
+
+	/* a watchdog reset leaves the watchdog running, WDRF has to go
+	   before it can be turned off */
+	status.reset_cause = MCUSR;
+	MCUSR = 0;
+	wdt_disable();
+
+	/* a blank EEPROM reads 0xFFFF, and 0 is "can't say" to the host */
+	status.boots = eeprom_read_word(&boots_ee) + 1;
+	if (!status.boots)
+		status.boots = 1;
+	eeprom_write_word(&boots_ee, status.boots);
 
 	/* enforce re-enumeration, do this while interrupts are disabled! */
 	usbDeviceDisconnect();
@@ -228,15 +469,46 @@ int main(void)
 
 	sei();
 
-	i = 0;
+	/* a wedged sensor or USB stack resets us instead of needing a
+	   power cycle, the host notices and puts the outputs back */
+	wdt_enable(WDTO_1S);
+
+	poll_mark = TCNT1;
+	poll_frames = 0;
 	for (;;) {                /* main event loop */
+		wdt_reset();
+		clock_update();
 		usbPoll();
 
+		/* timer1 runs at F_CPU/8 and wraps every 43 ms, saturate
+		   anything longer using the frame clock */
+		gap = TCNT1 - poll_mark;
+		poll_mark += gap;
+		if ((uint16_t) (frames - poll_frames) > 40)
+			gap = 0xFFFF;
+		poll_frames = frames;
+		if (status_read) {
+			status_read = 0;
+			status.max_gap = 0;
+		}
+		if (gap > status.max_gap)
+			status.max_gap = gap;
+
+		loops++;
+		if ((uint16_t) (frames - loop_mark) >= 1000) {
+			loop_mark = frames;
+			status.loops = loops;
+			loops = 0;
+		}
+
 		/* do the state machine for each temp sensor */
-		sensor = &sensors[i];
+		sensor = &sensors[cur];
 
 		switch (sensor->state) {
 		case IDLE:
+			/* a failed reset always lands here */
+			if (sensor->absent && (uint16_t) (frames - sensor->probe) < PROBE_FRAMES)
+				break;
 			if (ds1820_convert())
 				sensor->state = CONVERTING;
 			break;
@@ -252,8 +524,8 @@ int main(void)
 			break;
 		}
 
-		i++;
-		i &= 0x03;
+		cur++;
+		cur &= 0x03;
 	}
 
 	return 0;
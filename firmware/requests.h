@@ -1,13 +1,158 @@
-
 #ifndef __REQUESTS_H
 #define __REQUESTS_H
 
-#define THERMAL_RQ_ECHO             0
-#define THERMAL_RQ_TEMPS            1
-#define THERMAL_RQ_GUIDE            2
+/* The ScopeTemp wire protocol, shared by the firmware and the host side.
+   Vendor control requests, all multi-byte fields little endian. Payload
+   layouts are fixed, the asserts below keep both compilers honest. */
+
+#include <stdint.h>
+
+#define THERMAL_PROTOCOL_VERSION    3
+
+#define THERMAL_RQ_ECHO             0	/* returns wValue, wIndex */
+#define THERMAL_RQ_TEMPS            1	/* wValue = sensor, returns:
+					   sum (LE32, 1/16 C, of the conversions
+					   since the previous read),
+					   count (conversions in sum),
+					   seq (bumped per conversion, 0 = none yet),
+					   stamp (frame clock at last conversion, LE16),
+					   now (frame clock at request, LE16).
+					   The frame clock counts 1 ms USB SOFs.
+					   Version 1 boards return the first 4
+					   bytes of the sensor scratchpad instead */
+#define THERMAL_RQ_GUIDE            2	/* wValue = GUIDE_* outputs, cancels
+					   any THERMAL_RQ_PULSE in progress */
 #define THERMAL_RQ_FANS             3
+#define THERMAL_RQ_HEATER           4	/* wValue = cfg, wIndex = offset of
+					   the controlled sensor above the
+					   reference, 1/16 C */
+#define THERMAL_RQ_HEATER_GAINS     5	/* wValue = kp | ki << 8,
+					   wIndex = channel */
+#define THERMAL_RQ_HEATER_STATUS    6	/* wValue = channel, returns:
+					   cfg, kp, ki, flags (HEATER_LOST),
+					   offset, error (1/16 C, LE16),
+					   integ, out (PWM counts, LE16) */
+#define THERMAL_RQ_PULSE            7	/* wValue = GUIDE_* outputs | axis << 8,
+					   wIndex = milisec. Only touches the
+					   outputs of that axis, and switches
+					   them off again after wIndex frame
+					   boundaries, so wIndex - 1 to wIndex
+					   ms, and less than 1 ms more until
+					   the board looks at its frame clock.
+					   wIndex = 0 stops the axis */
+
+/* THERMAL_RQ_HEATER cfg byte */
+#define HEATER_SENSOR(cfg)     ((cfg) & 0x03)
+#define HEATER_REF(cfg)        (((cfg) >> 2) & 0x03)
+#define HEATER_CHANNEL(cfg)    (((cfg) >> 4) & 0x01)
+#define HEATER_ENABLE          0x80
+
+/* THERMAL_RQ_HEATER_STATUS flags: the controlled or the reference sensor
+   stopped answering, the channel is held at 0 until both are back */
+#define HEATER_LOST            0x01
+
+/* THERMAL_RQ_GUIDE and THERMAL_RQ_PULSE outputs, PORTD bits:
+   RA+  ... PD3
+   RA-  ... PD5
+   DEC+ ... PD6
+   DEC- ... PD4 */
+#define GUIDE_RA_PLUS   (1 << 3)
+#define GUIDE_RA_MINUS  (1 << 5)
+#define GUIDE_DEC_PLUS  (1 << 1)
+#define GUIDE_DEC_MINUS (1 << 4)
+
+#define GUIDE_DEC_MASK (GUIDE_DEC_PLUS | GUIDE_DEC_MINUS)
+#define GUIDE_RA_MASK  (GUIDE_RA_PLUS | GUIDE_RA_MINUS)
+#define GUIDE_MASK     (GUIDE_DEC_MASK | GUIDE_RA_MASK)
+
+#define GUIDE_AXIS_DEC 0
+#define GUIDE_AXIS_RA  1
+
+
+#define THERMAL_RQ_STATUS          10	/* returns, all LE16 or bytes:
+					   max_gap (longest usbPoll() gap since
+					   the last STATUS, F_CPU/8 ticks, 0xFFFF
+					   if longer than 40 ms),
+					   loops (main loop iterations last second),
+					   conversions (total),
+					   reset_err[4], crc_err[4] (per sensor,
+					   free running 8 bit counts),
+					   present (bit n set if sensor n answered
+					   its last reset pulse),
+					   reset_cause (MCUSR at boot),
+					   boots (EEPROM boot counter, LE16) */
+#define THERMAL_RQ_VERSION         11	/* returns version, pad, caps (LE16).
+					   Version 1 boards don't know it and
+					   reply with nothing */
+
+/* THERMAL_RQ_VERSION caps */
+#define THERMAL_CAP_STAMPS     0x0001	/* TEMPS returns struct thermal_sample */
+#define THERMAL_CAP_STATUS     0x0002
+#define THERMAL_CAP_HEATER     0x0004	/* HEATER, HEATER_GAINS, HEATER_STATUS */
+#define THERMAL_CAP_PRESENCE   0x0008	/* STATUS has the present bitmap */
+#define THERMAL_CAP_PULSE      0x0010
+#define THERMAL_CAP_WATCHDOG   0x0020	/* STATUS has reset_cause, boots */
+
+#define THERMAL_CAPS (THERMAL_CAP_STAMPS | THERMAL_CAP_STATUS | THERMAL_CAP_HEATER | \
+		      THERMAL_CAP_PRESENCE | THERMAL_CAP_PULSE | THERMAL_CAP_WATCHDOG)
+
+
+/* payloads */
+
+struct thermal_sample {
+	int32_t sum;
+	uint8_t count;
+	uint8_t seq;
+	uint16_t stamp;
+	uint16_t now;
+} __attribute__((packed));
+
+/* THERMAL_RQ_TEMPS on version 1 boards */
+struct thermal_sample_v1 {
+	uint8_t temp_lsb;
+	uint8_t temp_msb;
+	uint8_t count_remain;
+	uint8_t count_per_c;
+} __attribute__((packed));
+
+struct thermal_heater {
+	uint8_t cfg;
+	uint8_t kp;
+	uint8_t ki;
+	uint8_t flags;
+	int16_t offset;
+	int16_t error;
+	uint16_t integ;
+	uint16_t out;
+} __attribute__((packed));
+
+struct thermal_status {
+	uint16_t max_gap;
+	uint16_t loops;
+	uint16_t conversions;
+	uint8_t reset_err[4];
+	uint8_t crc_err[4];
+	uint8_t present;
+	uint8_t reset_cause;
+	uint16_t boots;
+} __attribute__((packed));
+
+struct thermal_version {
+	uint8_t version;
+	uint8_t pad;
+	uint16_t caps;
+} __attribute__((packed));
 
+#ifdef __cplusplus
+#define THERMAL_ASSERT_SIZE(type, size) static_assert(sizeof(struct type) == (size), #type " layout")
+#else
+#define THERMAL_ASSERT_SIZE(type, size) _Static_assert(sizeof(struct type) == (size), #type " layout")
+#endif
 
-#define THERMAL_RQ_STATUS          10
+THERMAL_ASSERT_SIZE(thermal_sample, 10);
+THERMAL_ASSERT_SIZE(thermal_sample_v1, 4);
+THERMAL_ASSERT_SIZE(thermal_heater, 12);
+THERMAL_ASSERT_SIZE(thermal_status, 18);
+THERMAL_ASSERT_SIZE(thermal_version, 4);
 
 #endif /* __REQUESTS_H */
@@ -0,0 +1,464 @@
+/* libscopetemp.cc -- ScopeTemp device access */
+
+#include <cstring>
+#include <cstddef>
+#include <cmath>
+#include <cstdio>
+
+#include <endian.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include "libscopetemp.h"
+#include "scopetemp-spans.h"
+
+ScopeTempDevice::ScopeTempDevice()
+{
+	transport = &usb;
+	clock = NULL;
+	fw_version = 0;
+	fw_caps = 0;
+	memset(legacy_seq, 0, sizeof(legacy_seq));
+	usb_error = 0;
+	memset(&st, 0, sizeof(st));
+}
+
+ScopeTempDevice::~ScopeTempDevice()
+{
+	close();
+}
+
+ScopeTempUsb::ScopeTempUsb()
+{
+	usb_ctx = NULL;
+	usb_handle = NULL;
+	usb_path[0] = usb_serial[0] = 0;
+}
+
+ScopeTempUsb::~ScopeTempUsb()
+{
+	close();
+}
+
+double ScopeTempDevice::now()
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+double ScopeTempDevice::monotonic()
+{
+	struct timespec ts;
+
+	if (clock)
+		return clock->mono();
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* a full speed frame is 1 ms, most transfers take one or two */
+double ScopeTempDevice::latencyBound(int i)
+{
+	static const double bounds[ST_LATENCY_BUCKETS] = {
+		0.0005, 0.001, 0.002, 0.003, 0.005, 0.01, 0.02, 0.05, 0.1, 0.5
+	};
+
+	return bounds[i];
+}
+
+/* bus-port.port..., the same as the kernel's sysfs name */
+static void device_path(libusb_device *dev, char *path, int len)
+{
+	uint8_t ports[8];
+	int i, n, p;
+
+	p = snprintf(path, len, "%d", libusb_get_bus_number(dev));
+	n = libusb_get_port_numbers(dev, ports, sizeof(ports));
+	for (i = 0; i < n && p < len; i++)
+		p += snprintf(path + p, len - p, "%c%d", i ? '.' : '-', ports[i]);
+}
+
+/* keeps it open if it's one of ours */
+bool ScopeTempUsb::tryOpen(libusb_device *dev)
+{
+	libusb_device_descriptor desc;
+	libusb_device_handle *handle;
+	uint32_t devID;
+	char manufacturer[32], product[32];
+
+	if (libusb_get_device_descriptor(dev, &desc) < 0)
+		return false;
+
+	/* voti.nl USB VID/PID for vendor class devices */
+	devID = (desc.idVendor << 16) + desc.idProduct;
+	if (devID != 0x16C005DC)
+		return false;
+
+	if (libusb_open(dev, &handle) < 0)
+		return false;
+
+	if ((libusb_get_string_descriptor_ascii(handle, desc.iManufacturer, (unsigned char *) manufacturer, 32) < 0) ||
+	    (libusb_get_string_descriptor_ascii(handle, desc.iProduct, (unsigned char *) product, 32) < 0)) {
+		libusb_close(handle);
+		return false;
+	}
+
+	if (strcmp(manufacturer, ST_MANUFACTURER) || strcmp(product, ST_PRODUCT)) {
+		libusb_close(handle);
+		return false;
+	}
+
+	usb_serial[0] = 0;
+	if (desc.iSerialNumber &&
+	    libusb_get_string_descriptor_ascii(handle, desc.iSerialNumber, (unsigned char *) usb_serial, sizeof(usb_serial)) < 0)
+		usb_serial[0] = 0;
+
+	device_path(dev, usb_path, sizeof(usb_path));
+	usb_handle = handle;
+
+	return true;
+}
+
+/* The VID/PID is shared with other hobby devices, a known path saves
+   opening those just to read their strings. */
+bool ScopeTempUsb::open(const char *path)
+{
+	libusb_device **devices;
+	char p[sizeof(usb_path)];
+	int i, n;
+
+	if (usb_handle)
+		return true;
+
+	if (!usb_ctx && libusb_init(&usb_ctx) < 0) {
+		usb_ctx = NULL;
+		return false;
+	}
+
+	n = libusb_get_device_list(usb_ctx, &devices);
+
+	for (i = 0; path && path[0] && i < n; i++) {
+		device_path(devices[i], p, sizeof(p));
+		if (!strcmp(p, path) && tryOpen(devices[i]))
+			break;
+	}
+
+	for (i = 0; !isOpen() && i < n; i++)
+		tryOpen(devices[i]);
+
+	if (n >= 0)
+		libusb_free_device_list(devices, 1);
+
+	return usb_handle ? true : false;
+}
+
+void ScopeTempUsb::close()
+{
+	if (usb_handle)
+		libusb_close(usb_handle);
+	usb_handle = NULL;
+
+	if (usb_ctx)
+		libusb_exit(usb_ctx);
+	usb_ctx = NULL;
+}
+
+int ScopeTempUsb::control(uint8_t type, uint8_t request, uint16_t value, uint16_t index,
+			  unsigned char *data, uint16_t len, unsigned int timeout)
+{
+	return libusb_control_transfer(usb_handle, type, request, value, index, data, len, timeout);
+}
+
+bool ScopeTempDevice::open(const char *path)
+{
+	if (transport->isOpen())
+		return true;
+
+	if (!transport->open(path))
+		return false;
+
+	if (!getVersion()) {
+		transport->close();
+		return false;
+	}
+
+	return true;
+}
+
+/* everything goes through here, so lastError() knows what went wrong */
+int ScopeTempDevice::control(uint8_t type, uint8_t request, uint16_t value, uint16_t index,
+			     unsigned char *data, uint16_t len, unsigned int timeout)
+{
+	ScopeTempSpan span(st_request_name(request), "usb", value);
+	double t = monotonic();
+	int i, rq = request & 15, ret = transport->control(type, request, value, index, data, len, timeout);
+
+	usb_error = ret < 0 ? ret : 0;
+
+	t = monotonic() - t;
+	st.count[rq]++;
+	st.errors[rq] += ret < 0;
+	st.sum[rq] += t;
+	for (i = 0; i < ST_LATENCY_BUCKETS; i++) {
+		if (t <= latencyBound(i)) {
+			st.bucket[rq][i]++;
+			break;
+		}
+	}
+
+	return ret;
+}
+
+/* version 1 boards don't know the request and send back nothing */
+bool ScopeTempDevice::getVersion()
+{
+	struct thermal_version v;
+	int len;
+
+	len = control(ST_READ, THERMAL_RQ_VERSION, 0, 0, (unsigned char *) &v, sizeof(v), 0);
+	if (len == 0) {
+		fw_version = 1;
+		fw_caps = 0;
+		return true;
+	}
+	if (len != sizeof(v))
+		return false;
+
+	fw_version = v.version;
+	fw_caps = le16toh(v.caps);
+
+	return true;
+}
+
+void ScopeTempDevice::close()
+{
+	transport->close();
+
+	fw_version = 0;
+	fw_caps = 0;
+}
+
+/* round trip of a small IN transfer, for latency measurements */
+bool ScopeTempDevice::echo(uint16_t value, uint16_t index)
+{
+	uint8_t buffer[4];
+
+	if (!isOpen() || control(ST_READ, THERMAL_RQ_ECHO, value, index, buffer, 4, 0) != 4)
+		return false;
+
+	return (buffer[0] | (buffer[1] << 8)) == value && (buffer[2] | (buffer[3] << 8)) == index;
+}
+
+/* TEMP_READ with the half degree bit dropped, - 0.25, + (COUNT_PER_C -
+   COUNT_REMAIN) / COUNT_PER_C, in 1/16 C the same as the firmware does */
+static inline int16_t scratchpad16(uint8_t lsb, uint8_t msb, uint8_t remain)
+{
+	return (int16_t) ((int16_t) (((msb << 8) | lsb) & ~1) * 8 + 16 - 4 - remain);
+}
+
+/* sum / count to the nearest, halves up */
+static int16_t mean16(int32_t sum, int count)
+{
+	int32_t n = 2 * sum + count, d = 2 * count;
+
+	return n >= 0 ? n / d : -((d - 1 - n) / d);
+}
+
+/* COUNT_PER_C is 16 on anything genuine, the rest to the nearest 1/16 */
+int16_t ScopeTempDevice::decodeScratchpad(const struct thermal_sample_v1 *raw)
+{
+	if (raw->count_per_c == 0)
+		return ST_TEMP_NONE;
+
+	if (raw->count_per_c == 16)
+		return scratchpad16(raw->temp_lsb, raw->temp_msb, raw->count_remain);
+
+	return scratchpad16(raw->temp_lsb, raw->temp_msb, 16) +
+		mean16(16 * (raw->count_per_c - raw->count_remain), raw->count_per_c);
+}
+
+/* the device averages all conversions since our previous read */
+bool ScopeTempDevice::getTemperature(int id, struct sample *s)
+{
+	struct thermal_sample raw;
+	double t0, t1;
+
+	if (!isOpen())
+		return false;
+
+	if (!hasCap(THERMAL_CAP_STAMPS))
+		return getTemperatureV1(id, s);
+
+	t0 = wallclock();
+	if (control(ST_READ, THERMAL_RQ_TEMPS, id, 0, (unsigned char *) &raw, sizeof(raw), 0) != sizeof(raw))
+		return false;
+	t1 = wallclock();
+
+	s->count = raw.count;
+	s->seq = raw.seq;
+	s->temp = s->count ? mean16((int32_t) le32toh(raw.sum), s->count) : 0;
+
+	/* the device clock counts 1 ms USB frames, the reply is built
+	   somewhere in the middle of the transfer */
+	s->when = (t0 + t1) / 2 - (uint16_t) (le16toh(raw.now) - le16toh(raw.stamp)) / 1000.0;
+
+	return true;
+}
+
+/* the last conversion, straight from the scratchpad, no idea when it was
+   made. Every read counts as a new one. */
+bool ScopeTempDevice::getTemperatureV1(int id, struct sample *s)
+{
+	struct thermal_sample_v1 raw;
+
+	if (control(ST_READ, THERMAL_RQ_TEMPS, id, 0, (unsigned char *) &raw, sizeof(raw), 0) != sizeof(raw))
+		return false;
+
+	/* a sensor that never answered reads as zeros */
+	if ((s->temp = decodeScratchpad(&raw)) == ST_TEMP_NONE) {
+		s->count = 0;
+		s->seq = 0;
+		s->temp = 0;
+		s->when = wallclock();
+		return true;
+	}
+
+	s->count = 1;
+	s->seq = ++legacy_seq[id & 3];
+	if (s->seq == 0)
+		s->seq = legacy_seq[id & 3] = 1;
+	s->when = wallclock();
+
+	return true;
+}
+
+bool ScopeTempDevice::setPWM(int pwm1, int pwm2)
+{
+	if (!isOpen() || control(ST_WRITE, THERMAL_RQ_FANS, pwm1, pwm2, NULL, 0, 0) != 0)
+		return false;
+
+	return true;
+}
+
+bool ScopeTempDevice::setGuiding(int n, int s, int w, int e)
+{
+	uint8_t val = 0;
+
+	val |= n ? GUIDE_DEC_PLUS : 0;
+	val |= s ? GUIDE_DEC_MINUS : 0;
+	val |= w ? GUIDE_RA_PLUS : 0;
+	val |= e ? GUIDE_RA_MINUS : 0;
+
+	if (!isOpen() || control(ST_WRITE, THERMAL_RQ_GUIDE, val, 0, NULL, 0, 0) != 0)
+		return false;
+
+	return true;
+}
+
+/* plus is N or W, minus S or E. The board switches the axis off by
+   itself after ms, and leaves the other one alone. */
+bool ScopeTempDevice::pulse(int axis, int plus, int minus, int ms)
+{
+	uint8_t val = 0;
+
+	if (axis == GUIDE_AXIS_DEC) {
+		val |= plus ? GUIDE_DEC_PLUS : 0;
+		val |= minus ? GUIDE_DEC_MINUS : 0;
+	} else {
+		val |= plus ? GUIDE_RA_PLUS : 0;
+		val |= minus ? GUIDE_RA_MINUS : 0;
+	}
+
+	if (!isOpen() || !hasCap(THERMAL_CAP_PULSE) ||
+	    control(ST_WRITE, THERMAL_RQ_PULSE, val | (axis << 8), ms, NULL, 0, 0) != 0)
+		return false;
+
+	return true;
+}
+
+bool ScopeTempDevice::getStatus(struct status *st)
+{
+	struct thermal_status raw;
+	int i, len, want;
+
+	if (!isOpen() || !hasCap(THERMAL_CAP_STATUS))
+		return false;
+
+	/* without the presence bitmap, assume they're all there */
+	if (hasCap(THERMAL_CAP_WATCHDOG))
+		want = sizeof(raw);
+	else if (hasCap(THERMAL_CAP_PRESENCE))
+		want = offsetof(struct thermal_status, reset_cause);
+	else
+		want = offsetof(struct thermal_status, present);
+	raw.present = 0x0F;
+	raw.reset_cause = 0;
+	raw.boots = 0;
+
+	len = control(ST_READ, THERMAL_RQ_STATUS, 0, 0, (unsigned char *) &raw, want, 0);
+	if (len != want)
+		return false;
+
+	i = le16toh(raw.max_gap);
+	st->max_gap = (i == 0xFFFF) ? 40.0 : i * 1000.0 / ST_TIMER_HZ;
+	st->loops = le16toh(raw.loops);
+	st->conversions = le16toh(raw.conversions);
+
+	for (i = 0; i < 4; i++) {
+		st->reset_err[i] = raw.reset_err[i];
+		st->crc_err[i] = raw.crc_err[i];
+	}
+	st->present = raw.present & 0x0F;
+	st->reset_cause = raw.reset_cause;
+	st->boots = le16toh(raw.boots);
+
+	return true;
+}
+
+bool ScopeTempDevice::setHeater(int ch, bool enable, int sensor, int ref, double offset)
+{
+	uint8_t cfg;
+	int16_t off;
+
+	cfg = (sensor & 0x03) | ((ref & 0x03) << 2) | ((ch & 0x01) << 4) | (enable ? HEATER_ENABLE : 0);
+	off = lround(offset * 16);
+
+	if (!isOpen() || control(ST_WRITE, THERMAL_RQ_HEATER, cfg, (uint16_t) off, NULL, 0, 0) != 0)
+		return false;
+
+	return true;
+}
+
+bool ScopeTempDevice::setHeaterGains(int ch, int kp, int ki)
+{
+	if (!isOpen() || control(ST_WRITE, THERMAL_RQ_HEATER_GAINS, (kp & 0xFF) | ((ki & 0xFF) << 8), ch, NULL, 0, 0) != 0)
+		return false;
+
+	return true;
+}
+
+bool ScopeTempDevice::getHeater(int ch, struct heater *h)
+{
+	struct thermal_heater raw;
+
+	if (!isOpen() || control(ST_READ, THERMAL_RQ_HEATER_STATUS, ch, 0, (unsigned char *) &raw, sizeof(raw), 0) != sizeof(raw))
+		return false;
+
+	h->enable = raw.cfg & HEATER_ENABLE;
+	h->sensor = HEATER_SENSOR(raw.cfg);
+	h->ref = HEATER_REF(raw.cfg);
+	h->kp = raw.kp;
+	h->ki = raw.ki;
+	h->offset = (int16_t) le16toh(raw.offset) / 16.0;
+	h->error = (int16_t) le16toh(raw.error) / 16.0;
+	h->integ = le16toh(raw.integ) * 100.0 / 65535;
+	h->out = le16toh(raw.out) * 100.0 / 65535;
+	h->lost = raw.flags & HEATER_LOST;
+
+	return true;
+}
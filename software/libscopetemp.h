@@ -0,0 +1,257 @@
+#ifndef __LIBSCOPETEMP_H
+#define __LIBSCOPETEMP_H
+
+#include <stdint.h>
+
+#include <libusb-1.0/libusb.h>
+
+#include "requests.h"
+
+
+#define ST_MANUFACTURER "mconovici@gmail.com"
+#define ST_PRODUCT "ScopeTemp"
+
+/* Temperatures go around as 1/16 C, what a DS1820 resolves and what the
+   board sums, and only become degrees to be shown. */
+#define ST_TEMP_SCALE 16
+#define ST_TEMP_NONE  INT16_MIN	/* nothing to decode */
+
+static inline double st_celsius(int16_t t)
+{
+	return t * (1.0 / ST_TEMP_SCALE);
+}
+
+/* Binary sample blocks, as sent in the driver's stream and burst BLOBs:
+   a header followed by count records, host (little) endian. */
+#define ST_BLOCK_MAGIC   0x42535453 /* "STSB" */
+#define ST_BLOCK_VERSION 1
+#define ST_BLOCK_FORMAT  ".stsb"
+
+struct st_block_header {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t count;
+	double t0;		/* s since the epoch */
+} __attribute__((packed));
+
+struct st_block_record {
+	int32_t dt;		/* last conversion - t0, ms */
+	uint8_t sensor;
+	uint8_t count;		/* conversions averaged */
+	int16_t temp;		/* 1/16 C */
+} __attribute__((packed));
+
+/* Transfer traces, see scopetemp-record.h: a header, then one record
+   per control transfer or open/close, each followed by its payload
+   (the bytes read for IN transfers that moved any, wLength bytes for
+   OUT ones, path and serial for ST_TRACE_OPEN). Host endian. */
+#define ST_TRACE_MAGIC   0x52545453 /* "STTR" */
+#define ST_TRACE_VERSION 1
+#define ST_TRACE_FORMAT  ".sttr"
+
+#define ST_TRACE_OPEN    1	/* request of a type 0 record, result 0 or -1 */
+#define ST_TRACE_CLOSE   2
+
+struct st_trace_header {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t pad;
+	double t0;		/* s since the epoch */
+} __attribute__((packed));
+
+struct st_trace_record {
+	uint64_t t;		/* start, us since t0 */
+	uint32_t duration;	/* us */
+	uint8_t type;		/* bmRequestType, 0 for open/close */
+	uint8_t request;
+	uint16_t value;
+	uint16_t index;
+	uint16_t length;	/* wLength, or of the payload */
+	int32_t result;		/* bytes moved or LIBUSB_ERROR_* */
+} __attribute__((packed));
+
+/* Where time comes from. The driver takes all its readings and timers
+   from one of these, so a whole night can run against a simulated board
+   in virtual time (see scopetemp-sim.h). */
+class ScopeTempClock {
+public:
+	virtual ~ScopeTempClock() {}
+
+	virtual double mono() = 0;	// s, monotonic
+	virtual double now() = 0;	// s since the epoch
+
+	/* one shot, returns an id for rmTimer() */
+	virtual int addTimer(int ms, void (*cb)(void *), void *p) = 0;
+	virtual void rmTimer(int id) = 0;
+};
+
+/* How the requests get to a board */
+class ScopeTempTransport {
+public:
+	virtual ~ScopeTempTransport() {}
+
+	/* tries path (see path()) first, if given */
+	virtual bool open(const char *path) = 0;
+	virtual void close() = 0;
+	virtual bool isOpen() = 0;
+
+	/* libusb_control_transfer(): bytes moved or LIBUSB_ERROR_* */
+	virtual int control(uint8_t type, uint8_t request, uint16_t value, uint16_t index,
+			    unsigned char *data, uint16_t len, unsigned int timeout) = 0;
+
+	/* of the last device opened, serial is empty if it has none */
+	virtual const char *path() = 0;
+	virtual const char *serial() = 0;
+};
+
+/* the real thing */
+class ScopeTempUsb : public ScopeTempTransport {
+public:
+	ScopeTempUsb();
+	~ScopeTempUsb();
+
+	bool open(const char *path);
+	void close();
+	bool isOpen() { return usb_handle != NULL; }
+
+	int control(uint8_t type, uint8_t request, uint16_t value, uint16_t index,
+		    unsigned char *data, uint16_t len, unsigned int timeout);
+
+	const char *path() { return usb_path; }
+	const char *serial() { return usb_serial; }
+
+private:
+	libusb_context *usb_ctx;
+	libusb_device_handle *usb_handle;
+
+	char usb_path[32];
+	char usb_serial[32];
+
+	bool tryOpen(libusb_device *dev);
+};
+
+/* ScopeTemp device access, no INDI in here */
+class ScopeTempDevice {
+
+	static const int ST_READ  = 0xC0;
+	static const int ST_WRITE = 0x40;
+
+	static const int ST_TIMER_HZ = 12000000 / 8; // firmware timer1
+
+public:
+
+	static const int ST_LATENCY_BUCKETS = 10;
+
+	/* control transfers by THERMAL_RQ_* (& 15), since construction */
+	struct stats {
+		unsigned long count[16];
+		unsigned long errors[16];	// result < 0
+		unsigned long bucket[16][ST_LATENCY_BUCKETS]; // took <= latencyBound(i), not cumulative
+		double sum[16];			// s
+	};
+
+	/* THERMAL_RQ_TEMPS, decoded. temp averages every conversion since
+	   the previous read, when is the last of them: the end of the
+	   window, not its middle. The window is as wide as the time
+	   between reads, so the mean belongs half of that before when. */
+	struct sample {
+		int16_t temp; // 1/16 C, mean of count conversions, to the nearest
+		int count;
+		uint8_t seq;  // 0 = nothing converted yet
+		double when;  // host time of the last conversion
+	};
+
+	/* THERMAL_RQ_STATUS, decoded */
+	struct status {
+		double max_gap; // milisec
+		int loops;
+		uint16_t conversions;
+		uint8_t reset_err[4];
+		uint8_t crc_err[4];
+		uint8_t present; // bit n = sensor n answers
+		uint8_t reset_cause; // MCUSR at boot, 0 if the board can't say
+		uint16_t boots;      // 0 if the board can't say
+	};
+
+	/* THERMAL_RQ_HEATER_STATUS, decoded */
+	struct heater {
+		bool enable;
+		int sensor, ref;
+		int kp, ki;
+		double offset; // C
+		double error;  // C
+		double integ;  // %
+		double out;    // %
+		bool lost;     // sensor or reference gone, output held at 0
+	};
+
+	ScopeTempDevice();
+	~ScopeTempDevice();
+
+	/* tries path (see path()) first, if given */
+	bool open(const char *path = NULL);
+	void close();
+	bool isOpen() { return transport->isOpen(); }
+
+	/* of the last device opened, serial is empty if it has none */
+	const char *path() { return transport->path(); }
+	const char *serial() { return transport->serial(); }
+
+	/* USB and the wall clock unless told otherwise. The device doesn't
+	   own them; a new transport has to be closed, or wrap the one in
+	   use (see ScopeTempRecorder). */
+	void setTransport(ScopeTempTransport *t) { transport = t ? t : &usb; }
+	ScopeTempTransport *getTransport() { return transport; }
+	void setClock(ScopeTempClock *c) { clock = c; }
+
+	/* LIBUSB_ERROR_* of the last transfer, 0 if it went through.
+	   LIBUSB_ERROR_NO_DEVICE means close() and open() again. */
+	int lastError() { return usb_error; }
+
+	const struct stats &getStats() { return st; }
+	static double latencyBound(int i);	// s
+
+	/* what the board said at open(), version 1 boards can't say */
+	int version() { return fw_version; }
+	int caps() { return fw_caps; }
+	bool hasCap(int cap) { return (fw_caps & cap) != 0; }
+
+	bool echo(uint16_t value, uint16_t index);
+	bool getTemperature(int id, struct sample *s);
+	bool setPWM(int pwm1, int pwm2);
+	bool setGuiding(int n, int s, int w, int e);
+	bool pulse(int axis, int plus, int minus, int ms);
+	bool getStatus(struct status *st);
+	bool setHeater(int ch, bool enable, int sensor, int ref, double offset);
+	bool setHeaterGains(int ch, int kp, int ki);
+	bool getHeater(int ch, struct heater *h);
+
+	/* wall clock, seconds */
+	static double now();
+
+	/* a version 1 TEMPS reply, scratchpad bytes 0, 1, 6 and 7, to 1/16
+	   C. ST_TEMP_NONE for a sensor that never answered (all zeros). */
+	static int16_t decodeScratchpad(const struct thermal_sample_v1 *raw);
+
+private:
+	ScopeTempUsb usb;
+	ScopeTempTransport *transport;
+	ScopeTempClock *clock;
+
+	int usb_error;
+	struct stats st;
+
+	double wallclock() { return clock ? clock->now() : now(); }
+	double monotonic();
+	int control(uint8_t type, uint8_t request, uint16_t value, uint16_t index,
+		    unsigned char *data, uint16_t len, unsigned int timeout);
+
+	int fw_version;
+	uint16_t fw_caps;
+	uint8_t legacy_seq[4];
+
+	bool getVersion();
+	bool getTemperatureV1(int id, struct sample *s);
+};
+
+#endif
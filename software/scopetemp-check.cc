@@ -0,0 +1,54 @@
+/* scopetemp-check.cc -- the 1/16 C scratchpad decoding against the
+   floating point formula it replaced, over the DS18S20's whole range */
+
+#include <cstdio>
+#include <cmath>
+
+#include "libscopetemp.h"
+
+/* what getTemperatureV1 used to report, in C */
+static double scratchpad_old(const struct thermal_sample_v1 *raw)
+{
+	return (((int8_t) raw->temp_msb << 8) + (raw->temp_lsb & 0xFE)) / 2.0 - 0.25 +
+		(raw->count_per_c - raw->count_remain) / (1.0 * raw->count_per_c);
+}
+
+int main()
+{
+	struct thermal_sample_v1 raw;
+	unsigned long checked = 0, bad = 0;
+	int temp, cpc, remain;
+	int16_t t, want;
+
+	raw.temp_lsb = raw.temp_msb = raw.count_remain = raw.count_per_c = 0;
+	if (ScopeTempDevice::decodeScratchpad(&raw) != ST_TEMP_NONE) {
+		printf("FAIL: a silent sensor decodes as %d\n", ScopeTempDevice::decodeScratchpad(&raw));
+		bad++;
+	}
+
+	/* TEMP_READ in 0.5 C, -55 to +125 C; 16 exact, the rest the nearest 1/16, halves up */
+	for (temp = -110; temp <= 250; temp++) {
+		raw.temp_lsb = temp & 0xFF;
+		raw.temp_msb = (temp >> 8) & 0xFF;
+
+		for (cpc = 1; cpc <= 255; cpc++) {
+			raw.count_per_c = cpc;
+
+			for (remain = 0; remain <= cpc; remain++) {
+				raw.count_remain = remain;
+
+				t = ScopeTempDevice::decodeScratchpad(&raw);
+				want = (int16_t) floor(scratchpad_old(&raw) * 16 + 0.5);
+				checked++;
+
+				if (t != want && bad++ < 10)
+					printf("FAIL: TEMP_READ %d COUNT_REMAIN %d COUNT_PER_C %d: %d/16, want %d/16 (%.4f C)\n",
+					       temp, remain, cpc, t, want, scratchpad_old(&raw));
+			}
+		}
+	}
+
+	printf("scratchpad   %lu checked, %lu bad\n", checked, bad);
+
+	return bad ? 1 : 0;
+}
@@ -0,0 +1,195 @@
+/* scopetemp-cli.cc -- ScopeTemp command line tool */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <time.h>
+#include <unistd.h>
+
+#include "libscopetemp.h"
+
+static double mono()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void sleep_until(double t)
+{
+	struct timespec ts;
+
+	ts.tv_sec = (time_t) t;
+	ts.tv_nsec = (long) ((t - ts.tv_sec) * 1e9);
+	clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+}
+
+static void usage()
+{
+	fprintf(stderr,
+		"usage: scopetemp-cli <command> [args]\n"
+		"  sample [count] [interval ms]  print temperatures, one line per sample\n"
+		"  version                       print the protocol version and caps\n"
+		"  status                        print the device counters\n"
+		"  pwm <pwm1 %%> <pwm2 %%>         set the PWM outputs\n"
+		"  pulse <n|s|e|w> <ms>          timed guide pulse\n"
+		"  bench [count]                 temperature transfer throughput\n");
+	exit(2);
+}
+
+static int cmd_sample(ScopeTempDevice &dev, int count, int interval)
+{
+	ScopeTempDevice::sample s;
+	double next = mono();
+	int i, id;
+
+	for (i = 0; count <= 0 || i < count; i++) {
+		printf("%.3f", ScopeTempDevice::now());
+		for (id = 0; id < 4; id++) {
+			if (dev.getTemperature(id, &s) && s.count)
+				printf(" %6.2f", st_celsius(s.temp));
+			else
+				printf("    nan");
+		}
+		printf("\n");
+		fflush(stdout);
+
+		next += interval / 1000.0;
+		sleep_until(next);
+	}
+
+	return 0;
+}
+
+static int cmd_status(ScopeTempDevice &dev)
+{
+	ScopeTempDevice::status st;
+	int i;
+
+	if (!dev.getStatus(&st)) {
+		fprintf(stderr, "status request failed\n");
+		return 1;
+	}
+
+	printf("loops/s      %d\n", st.loops);
+	printf("max gap ms   %.2f\n", st.max_gap);
+	printf("conversions  %u\n", st.conversions);
+	for (i = 0; i < 4; i++)
+		printf("T%d           reset %u crc %u%s\n", i + 1, st.reset_err[i], st.crc_err[i],
+		       (st.present & (1 << i)) ? "" : " absent");
+
+	return 0;
+}
+
+static int cmd_version(ScopeTempDevice &dev)
+{
+	printf("protocol     %d\n", dev.version());
+	printf("stamps       %s\n", dev.hasCap(THERMAL_CAP_STAMPS) ? "yes" : "no");
+	printf("status       %s\n", dev.hasCap(THERMAL_CAP_STATUS) ? "yes" : "no");
+	printf("heater       %s\n", dev.hasCap(THERMAL_CAP_HEATER) ? "yes" : "no");
+	printf("presence     %s\n", dev.hasCap(THERMAL_CAP_PRESENCE) ? "yes" : "no");
+	printf("pulse        %s\n", dev.hasCap(THERMAL_CAP_PULSE) ? "yes" : "no");
+
+	return 0;
+}
+
+/* times are of the middle of each transfer */
+static int cmd_pulse(ScopeTempDevice &dev, char dir, int ms)
+{
+	double t0, t1, t2, t3;
+	int n = 0, s = 0, w = 0, e = 0;
+
+	switch (dir) {
+	case 'n': n = 1; break;
+	case 's': s = 1; break;
+	case 'w': w = 1; break;
+	case 'e': e = 1; break;
+	default: usage();
+	}
+
+	t0 = mono();
+	if (!dev.setGuiding(n, s, w, e)) {
+		fprintf(stderr, "guide request failed\n");
+		return 1;
+	}
+	t1 = mono();
+
+	sleep_until((t0 + t1) / 2 + ms / 1000.0);
+
+	t2 = mono();
+	if (!dev.setGuiding(0, 0, 0, 0)) {
+		fprintf(stderr, "guide request failed, outputs may still be on!\n");
+		return 1;
+	}
+	t3 = mono();
+
+	printf("start %.3f ms, stop %.3f ms, pulse %.3f ms (asked %d)\n",
+	       (t1 - t0) * 1000, (t3 - t2) * 1000, ((t2 + t3) - (t0 + t1)) / 2 * 1000, ms);
+
+	return 0;
+}
+
+static int cmd_bench(ScopeTempDevice &dev, int count)
+{
+	ScopeTempDevice::sample s;
+	double start, t0, t, min = 1e9, max = 0, sum = 0;
+	int i, fail = 0;
+
+	start = mono();
+	for (i = 0; i < count; i++) {
+		t0 = mono();
+		if (!dev.getTemperature(i & 3, &s))
+			fail++;
+		t = mono() - t0;
+
+		sum += t;
+		if (t < min)
+			min = t;
+		if (t > max)
+			max = t;
+	}
+	t = mono() - start;
+
+	printf("%d transfers in %.3f s, %.1f/s, latency min %.3f avg %.3f max %.3f ms, %d failed\n",
+	       count, t, count / t, min * 1000, sum / count * 1000, max * 1000, fail);
+
+	return fail ? 1 : 0;
+}
+
+int main(int argc, char *argv[])
+{
+	ScopeTempDevice dev;
+
+	if (argc < 2)
+		usage();
+
+	if (!dev.open()) {
+		fprintf(stderr, "no %s found\n", ST_PRODUCT);
+		return 1;
+	}
+
+	if (!strcmp(argv[1], "sample"))
+		return cmd_sample(dev, argc > 2 ? atoi(argv[2]) : 1, argc > 3 ? atoi(argv[3]) : 1000);
+
+	if (!strcmp(argv[1], "version"))
+		return cmd_version(dev);
+
+	if (!strcmp(argv[1], "status"))
+		return cmd_status(dev);
+
+	if (!strcmp(argv[1], "pwm") && argc > 3)
+		return dev.setPWM(atof(argv[2]) / 100.0 * 65535, atof(argv[3]) / 100.0 * 65535) ? 0 : 1;
+
+	if (!strcmp(argv[1], "pulse") && argc > 3)
+		return cmd_pulse(dev, argv[2][0], atoi(argv[3]));
+
+	if (!strcmp(argv[1], "bench"))
+		return cmd_bench(dev, argc > 2 ? atoi(argv[2]) : 1000);
+
+	usage();
+
+	return 2;
+}
@@ -0,0 +1,261 @@
+/* scopetemp-metrics.cc -- Prometheus metrics socket */
+
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <cerrno>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <indidevapi.h>
+
+#include "scopetemp-metrics.h"
+
+ScopeTempMetrics::ScopeTempMetrics()
+{
+	fd = -1;
+	cb = 0;
+	path[0] = 0;
+	render = NULL;
+	arg = NULL;
+	accepted = 0;
+
+	for (int i = 0; i < ST_METRICS_CLIENTS; i++) {
+		clients[i].server = this;
+		clients[i].fd = -1;
+		clients[i].cb = 0;
+		clients[i].timer = 0;
+	}
+}
+
+ScopeTempMetrics::~ScopeTempMetrics()
+{
+	close();
+}
+
+static bool nonblock(int fd)
+{
+	int flags = fcntl(fd, F_GETFL);
+
+	return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+bool ScopeTempMetrics::listen(const char *where, Render render, void *p)
+{
+	char *end;
+	long port;
+
+	close();
+
+	if (!where || !where[0])
+		return true;
+
+	this->render = render;
+	this->arg = p;
+
+	port = strtol(where, &end, 10);
+	if (!*end && port > 0 && port < 65536) {
+		struct sockaddr_in sin;
+		int on = 1;
+
+		if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+			return false;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+		memset(&sin, 0, sizeof(sin));
+		sin.sin_family = AF_INET;
+		sin.sin_port = htons(port);
+		sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+		if (bind(fd, (struct sockaddr *) &sin, sizeof(sin)) < 0)
+			goto fail;
+	} else {
+		struct sockaddr_un sun;
+		struct stat sb;
+
+		if (strlen(where) >= sizeof(sun.sun_path)) {
+			errno = ENAMETOOLONG;
+			return false;
+		}
+		if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+			return false;
+
+		/* left over from a previous run */
+		if (stat(where, &sb) == 0 && S_ISSOCK(sb.st_mode))
+			unlink(where);
+
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		strcpy(sun.sun_path, where);
+
+		if (bind(fd, (struct sockaddr *) &sun, sizeof(sun)) < 0)
+			goto fail;
+		strcpy(path, where);
+	}
+
+	if (!nonblock(fd) || ::listen(fd, ST_METRICS_CLIENTS) < 0)
+		goto fail;
+
+	cb = IEAddCallback(fd, acceptClient, this);
+
+	return true;
+
+fail:
+	int err = errno;
+
+	close();
+	errno = err;
+
+	return false;
+}
+
+void ScopeTempMetrics::close()
+{
+	int i;
+
+	for (i = 0; i < ST_METRICS_CLIENTS; i++)
+		drop(&clients[i]);
+
+	if (fd >= 0) {
+		IERmCallback(cb);
+		::close(fd);
+	}
+	fd = -1;
+	cb = 0;
+
+	if (path[0])
+		unlink(path);
+	path[0] = 0;
+}
+
+void ScopeTempMetrics::drop(struct client *c)
+{
+	if (c->fd < 0)
+		return;
+
+	if (c->timer)
+		IERmTimer(c->timer);
+	if (c->cb)
+		IERmCallback(c->cb);
+	::close(c->fd);
+
+	c->fd = -1;
+	c->cb = 0;
+	c->timer = 0;
+	c->in.clear();
+	c->out.clear();
+}
+
+/* a full house makes room by dropping whoever has been there longest */
+void ScopeTempMetrics::acceptClient(int fd, void *p)
+{
+	ScopeTempMetrics *m = (ScopeTempMetrics *) p;
+	struct client *c = NULL;
+	int i, cfd;
+
+	if ((cfd = accept(fd, NULL, NULL)) < 0)
+		return;
+
+	if (!nonblock(cfd)) {
+		::close(cfd);
+		return;
+	}
+
+	for (i = 0; i < ST_METRICS_CLIENTS; i++) {
+		if (m->clients[i].fd < 0) {
+			c = &m->clients[i];
+			break;
+		}
+		if (!c || m->clients[i].since < c->since)
+			c = &m->clients[i];
+	}
+	m->drop(c);
+
+	c->fd = cfd;
+	c->since = ++m->accepted;
+	c->sent = 0;
+	c->cb = IEAddCallback(cfd, readClient, c);
+}
+
+void ScopeTempMetrics::readClient(int fd, void *p)
+{
+	struct client *c = (struct client *) p;
+	char buf[512];
+	ssize_t n;
+	bool http;
+
+	n = read(fd, buf, sizeof(buf));
+	if (n < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (n < 0) {
+		c->server->drop(c);
+		return;
+	}
+	c->in.append(buf, n);
+
+	http = c->in.compare(0, 4, "GET ") == 0;
+
+	if (n == 0 || (int) c->in.size() >= ST_METRICS_REQUEST ||
+	    (http && (c->in.find("\r\n\r\n") != std::string::npos || c->in.find("\n\n") != std::string::npos)))
+		c->server->respond(c, http);
+}
+
+void ScopeTempMetrics::respond(struct client *c, bool http)
+{
+	std::string body;
+	char header[160];
+
+	render(body, arg);
+
+	if (http) {
+		snprintf(header, sizeof(header),
+			 "HTTP/1.0 200 OK\r\n"
+			 "Content-Type: text/plain; version=0.0.4\r\n"
+			 "Content-Length: %zu\r\n"
+			 "Connection: close\r\n\r\n", body.size());
+		c->out = header;
+	}
+	c->out += body;
+	c->sent = 0;
+
+	/* nothing more to hear, and a half closed socket stays readable */
+	IERmCallback(c->cb);
+	c->cb = 0;
+
+	flush(c);
+}
+
+void ScopeTempMetrics::flush(struct client *c)
+{
+	ssize_t n;
+
+	c->timer = 0;
+
+	while (c->sent < c->out.size()) {
+		n = send(c->fd, c->out.data() + c->sent, c->out.size() - c->sent, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && errno == EAGAIN) {
+			c->timer = IEAddTimer(ST_METRICS_RETRY, retryWrite, c);
+			return;
+		}
+		if (n < 0)
+			break;
+		c->sent += n;
+	}
+
+	drop(c);
+}
+
+void ScopeTempMetrics::retryWrite(void *p)
+{
+	struct client *c = (struct client *) p;
+
+	c->server->flush(c);
+}
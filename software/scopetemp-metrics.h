@@ -0,0 +1,58 @@
+#ifndef __SCOPETEMP_METRICS_H
+#define __SCOPETEMP_METRICS_H
+
+/* Prometheus text exposition over a local socket, out of the INDI event
+   loop. Nothing here ever blocks: the sockets are non-blocking, a reply
+   the socket won't take in one go is finished from a timer, and a slow
+   client loses its slot to the next one. Speaks just enough HTTP/1.0
+   for a scraper; anything that doesn't start with GET gets the bare
+   text once it shuts down its side (socat, nc -U). */
+
+#include <string>
+
+class ScopeTempMetrics {
+
+	static const int ST_METRICS_CLIENTS = 4;
+	static const int ST_METRICS_REQUEST = 2048; // bytes, then we answer anyway
+	static const int ST_METRICS_RETRY = 10;     // milisec
+
+public:
+	typedef void (*Render)(std::string &out, void *p);
+
+	ScopeTempMetrics();
+	~ScopeTempMetrics();
+
+	/* a port number listens on 127.0.0.1, anything else is the path
+	   of a Unix socket */
+	bool listen(const char *where, Render render, void *p);
+	void close();
+	bool listening() { return fd >= 0; }
+
+private:
+	struct client {
+		ScopeTempMetrics *server;
+		int fd;
+		int cb;		// IEAddCallback id
+		int timer;	// write retry, 0 = none
+		unsigned long since;
+		std::string in, out;
+		size_t sent;
+	};
+
+	int fd, cb;
+	char path[108];
+	Render render;
+	void *arg;
+	unsigned long accepted;
+	struct client clients[ST_METRICS_CLIENTS];
+
+	static void acceptClient(int fd, void *p);
+	static void readClient(int fd, void *p);
+	static void retryWrite(void *p);
+
+	void respond(struct client *c, bool http);
+	void flush(struct client *c);
+	void drop(struct client *c);
+};
+
+#endif
@@ -0,0 +1,278 @@
+/* scopetemp-record.cc -- control transfer trace record and replay */
+
+#include <cstring>
+#include <cstdio>
+#include <cmath>
+
+#include <time.h>
+
+#include "scopetemp-record.h"
+
+ScopeTempRecorder::ScopeTempRecorder()
+{
+	inner = NULL;
+	clock = NULL;
+	f = NULL;
+	t0 = 0;
+	nrecords = 0;
+}
+
+ScopeTempRecorder::~ScopeTempRecorder()
+{
+	stop();
+}
+
+double ScopeTempRecorder::mono()
+{
+	struct timespec ts;
+
+	if (clock)
+		return clock->mono();
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+bool ScopeTempRecorder::start(const char *file, ScopeTempTransport *inner, ScopeTempClock *clock)
+{
+	struct st_trace_header h;
+
+	stop();
+
+	if (!(f = fopen(file, "wb")))
+		return false;
+
+	/* written out in big pieces, not per transfer */
+	setvbuf(f, NULL, _IOFBF, 1 << 16);
+
+	this->inner = inner;
+	this->clock = clock;
+	t0 = mono();
+	nrecords = 0;
+
+	h.magic = ST_TRACE_MAGIC;
+	h.version = ST_TRACE_VERSION;
+	h.pad = 0;
+	h.t0 = clock ? clock->now() : ScopeTempDevice::now();
+
+	if (fwrite(&h, sizeof(h), 1, f) != 1) {
+		stop();
+		return false;
+	}
+
+	/* started on an open board, the trace still begins with an open */
+	if (inner->isOpen())
+		writeOpen(t0, t0, true);
+
+	return true;
+}
+
+/* the transport stays usable, unrecorded, until the caller swaps it out */
+void ScopeTempRecorder::stop()
+{
+	if (f)
+		fclose(f);
+	f = NULL;
+}
+
+void ScopeTempRecorder::write(double start, double end, uint8_t type, uint8_t request, uint16_t value,
+			      uint16_t index, int result, const unsigned char *payload, uint16_t len)
+{
+	struct st_trace_record r;
+
+	if (!f)
+		return;
+
+	r.t = llround((start - t0) * 1e6);
+	r.duration = lround((end - start) * 1e6);
+	r.type = type;
+	r.request = request;
+	r.value = value;
+	r.index = index;
+	r.length = payload ? len : 0;
+	r.result = result;
+
+	fwrite(&r, sizeof(r), 1, f);
+	if (payload && len)
+		fwrite(payload, len, 1, f);
+
+	nrecords++;
+}
+
+void ScopeTempRecorder::writeOpen(double start, double end, bool ok)
+{
+	unsigned char names[64];
+
+	memset(names, 0, sizeof(names));
+	if (ok) {
+		strncpy((char *) names, inner->path(), 31);
+		strncpy((char *) names + 32, inner->serial(), 31);
+	}
+	write(start, end, 0, ST_TRACE_OPEN, 0, 0, ok ? 0 : -1, names, sizeof(names));
+}
+
+bool ScopeTempRecorder::open(const char *path)
+{
+	double t = mono();
+	bool ok = inner->open(path);
+
+	writeOpen(t, mono(), ok);
+
+	return ok;
+}
+
+void ScopeTempRecorder::close()
+{
+	double t = mono();
+
+	inner->close();
+	write(t, mono(), 0, ST_TRACE_CLOSE, 0, 0, 0, NULL, 0);
+
+	/* a board that went away is when someone wants to look */
+	if (f)
+		fflush(f);
+}
+
+int ScopeTempRecorder::control(uint8_t type, uint8_t request, uint16_t value, uint16_t index,
+			       unsigned char *data, uint16_t len, unsigned int timeout)
+{
+	double t = mono();
+	int ret = inner->control(type, request, value, index, data, len, timeout);
+
+	if (type & 0x80)
+		write(t, mono(), type, request, value, index, ret, data, ret > 0 ? ret : 0);
+	else
+		write(t, mono(), type, request, value, index, ret, data, len);
+
+	return ret;
+}
+
+
+ScopeTempReplay::ScopeTempReplay(VirtualClock *clock)
+{
+	this->clock = clock;
+	next = 0;
+	t0 = 0;
+	opened = false;
+	usb_path[0] = usb_serial[0] = 0;
+	nreplayed = nskipped = nmissed = 0;
+}
+
+/* a trace cut short by a crash still plays up to its last whole record */
+bool ScopeTempReplay::load(const char *file)
+{
+	struct st_trace_header h;
+	struct st_trace_record r;
+	unsigned char buf[4096];
+	size_t n, pos;
+	FILE *f;
+
+	if (!(f = fopen(file, "rb")))
+		return false;
+
+	if (fread(&h, sizeof(h), 1, f) != 1 || h.magic != ST_TRACE_MAGIC || h.version != ST_TRACE_VERSION) {
+		fclose(f);
+		return false;
+	}
+	t0 = h.t0;
+
+	trace.clear();
+	while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+		trace.insert(trace.end(), buf, buf + n);
+	fclose(f);
+
+	offsets.clear();
+	for (pos = 0; pos + sizeof(r) <= trace.size(); pos += sizeof(r) + r.length) {
+		memcpy(&r, &trace[pos], sizeof(r));
+		if (pos + sizeof(r) + r.length > trace.size())
+			break;
+		offsets.push_back(pos);
+	}
+
+	next = 0;
+
+	return true;
+}
+
+double ScopeTempReplay::length()
+{
+	return offsets.empty() ? 0 : record(offsets.size() - 1)->t / 1e6;
+}
+
+/* the next open in the trace decides */
+bool ScopeTempReplay::open(const char *path)
+{
+	size_t i;
+
+	for (i = next; i < offsets.size(); i++) {
+		const struct st_trace_record *r = record(i);
+
+		if (r->type != 0 || r->request != ST_TRACE_OPEN)
+			continue;
+
+		nskipped += i - next;
+		next = i + 1;
+		if (clock)
+			clock->advance(r->duration / 1e6);
+
+		if (r->result < 0)
+			return false;
+
+		snprintf(usb_path, sizeof(usb_path), "%.31s", (const char *) payload(i));
+		snprintf(usb_serial, sizeof(usb_serial), "%.31s", (const char *) payload(i) + 32);
+		opened = true;
+
+		return true;
+	}
+
+	next = offsets.size();
+
+	return false;
+}
+
+void ScopeTempReplay::close()
+{
+	if (next < offsets.size() && record(next)->type == 0 && record(next)->request == ST_TRACE_CLOSE)
+		next++;
+
+	opened = false;
+}
+
+int ScopeTempReplay::control(uint8_t type, uint8_t request, uint16_t value, uint16_t index,
+			     unsigned char *data, uint16_t len, unsigned int timeout)
+{
+	size_t i;
+
+	if (!opened || next >= offsets.size())
+		return LIBUSB_ERROR_NO_DEVICE;
+
+	for (i = next; i < offsets.size() && i < next + ST_REPLAY_WINDOW; i++) {
+		const struct st_trace_record *r = record(i);
+		int ret = r->result;
+
+		/* not past an open or close, those are the driver's own */
+		if (r->type == 0)
+			break;
+
+		if (r->type != type || r->request != request || r->value != value)
+			continue;
+
+		nskipped += i - next;
+		next = i + 1;
+		nreplayed++;
+
+		if ((type & 0x80) && ret > 0) {
+			ret = ret < len ? ret : len;
+			memcpy(data, payload(i), ret);
+		}
+		if (clock)
+			clock->advance(r->duration / 1e6);
+
+		return ret;
+	}
+
+	nmissed++;
+
+	return LIBUSB_ERROR_TIMEOUT;
+}
@@ -0,0 +1,106 @@
+#ifndef __SCOPETEMP_RECORD_H
+#define __SCOPETEMP_RECORD_H
+
+/* Control transfer traces (ST_TRACE_FORMAT in libscopetemp.h): recorded
+   in the field by wrapping the transport in use, played back into the
+   driver at the desk. */
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "libscopetemp.h"
+#include "scopetemp-sim.h"
+
+/* passes everything through to another transport, writing it down */
+class ScopeTempRecorder : public ScopeTempTransport {
+public:
+	ScopeTempRecorder();
+	~ScopeTempRecorder();
+
+	/* truncates file. Times come from clock, or CLOCK_MONOTONIC. */
+	bool start(const char *file, ScopeTempTransport *inner, ScopeTempClock *clock = NULL);
+	void stop();
+
+	bool recording() { return f != NULL; }
+	ScopeTempTransport *wrapped() { return inner; }
+	unsigned long records() { return nrecords; }
+
+	bool open(const char *path);
+	void close();
+	bool isOpen() { return inner->isOpen(); }
+
+	int control(uint8_t type, uint8_t request, uint16_t value, uint16_t index,
+		    unsigned char *data, uint16_t len, unsigned int timeout);
+
+	const char *path() { return inner->path(); }
+	const char *serial() { return inner->serial(); }
+
+private:
+	ScopeTempTransport *inner;
+	ScopeTempClock *clock;
+	FILE *f;
+	double t0;
+	unsigned long nrecords;
+
+	double mono();
+	void write(double start, double end, uint8_t type, uint8_t request, uint16_t value,
+		   uint16_t index, int result, const unsigned char *payload, uint16_t len);
+	void writeOpen(double start, double end, bool ok);
+};
+
+/* Serves a recorded trace back, in order. The driver may well ask in a
+   different order, what a guider or a client did in the field doesn't
+   happen here: a request is matched against the next ST_REPLAY_WINDOW
+   recorded ones on type, request and wValue, whatever it passes over is
+   skipped. With a clock, every transfer takes as long as it did. */
+class ScopeTempReplay : public ScopeTempTransport {
+
+	static const int ST_REPLAY_WINDOW = 64;
+
+public:
+	ScopeTempReplay(VirtualClock *clock = NULL);
+
+	bool load(const char *file);
+
+	/* of the trace */
+	double start() { return t0; }
+	double length();
+
+	bool open(const char *path);
+	void close();
+	bool isOpen() { return opened; }
+
+	/* LIBUSB_ERROR_TIMEOUT if nothing in the window matches,
+	   LIBUSB_ERROR_NO_DEVICE once the trace runs out */
+	int control(uint8_t type, uint8_t request, uint16_t value, uint16_t index,
+		    unsigned char *data, uint16_t len, unsigned int timeout);
+
+	const char *path() { return usb_path; }
+	const char *serial() { return usb_serial; }
+
+	unsigned long replayed() { return nreplayed; }
+	unsigned long skipped() { return nskipped; }
+	unsigned long missed() { return nmissed; }
+
+	/* every record, for summaries */
+	size_t records() { return offsets.size(); }
+	const struct st_trace_record *record(size_t i) { return (const struct st_trace_record *) &trace[offsets[i]]; }
+	const unsigned char *payload(size_t i) { return &trace[offsets[i] + sizeof(struct st_trace_record)]; }
+
+private:
+	VirtualClock *clock;
+	std::vector<unsigned char> trace;
+	std::vector<size_t> offsets;	// of each record
+	size_t next;
+	double t0;
+
+	bool opened;
+	char usb_path[32];
+	char usb_serial[32];
+
+	unsigned long nreplayed, nskipped, nmissed;
+};
+
+#endif
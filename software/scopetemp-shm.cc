@@ -0,0 +1,134 @@
+/* scopetemp-shm.cc -- seqlock protected shared memory publication */
+
+#include <cmath>
+#include <cstddef>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "libscopetemp.h"
+#include "scopetemp-shm.h"
+
+static_assert(sizeof(struct st_shm) % sizeof(uint32_t) == 0, "st_shm is whole words");
+
+static const size_t ST_SHM_SEQ = offsetof(struct st_shm, seq) / sizeof(uint32_t);
+
+ScopeTempShm::ScopeTempShm()
+{
+	shm = NULL;
+	memset(&data, 0, sizeof(data));
+}
+
+ScopeTempShm::~ScopeTempShm()
+{
+	close();
+}
+
+bool ScopeTempShm::open(const char *name)
+{
+	void *p;
+	int fd, i;
+
+	if (shm)
+		return true;
+
+	fd = shm_open(name, O_RDWR | O_CREAT, 0644);
+	if (fd < 0)
+		return false;
+
+	if (ftruncate(fd, sizeof(*shm)) < 0) {
+		::close(fd);
+		return false;
+	}
+
+	p = mmap(NULL, sizeof(*shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	::close(fd);
+	if (p == MAP_FAILED)
+		return false;
+
+	shm = (struct st_shm *) p;
+
+	/* a previous run may have left it mid-update */
+	if (__atomic_load_n(&shm->seq, __ATOMIC_RELAXED) & 1)
+		__atomic_fetch_add(&shm->seq, 1, __ATOMIC_RELEASE);
+
+	memset(&data, 0, sizeof(data));
+	data.magic = ST_SHM_MAGIC;
+	data.version = ST_SHM_VERSION;
+	data.connected = 1;
+	for (i = 0; i < 4; i++)
+		data.temp[i] = NAN;
+	publish();
+
+	return true;
+}
+
+/* the segment stays around for the next run, readers just see we're gone */
+void ScopeTempShm::close()
+{
+	if (!shm)
+		return;
+
+	data.connected = 0;
+	publish();
+
+	munmap(shm, sizeof(*shm));
+	shm = NULL;
+}
+
+/* The seqlock writer: odd seq, a release fence so no word lands before
+   it, the words as relaxed atomics, then even seq with release so none
+   land after it. There is only one writer, so a relaxed read of seq
+   is all it takes. */
+void ScopeTempShm::publish()
+{
+	uint32_t words[ST_SHM_WORDS];
+	uint32_t *dst = (uint32_t *) shm;
+	uint32_t seq = __atomic_load_n(&shm->seq, __ATOMIC_RELAXED);
+	size_t i;
+
+	data.updated = ScopeTempDevice::now();
+	data.seq = seq + 2;
+	memcpy(words, &data, sizeof(words));
+
+	__atomic_store_n(&shm->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	for (i = 0; i < ST_SHM_WORDS; i++) {
+		if (i != ST_SHM_SEQ)
+			__atomic_store_n(&dst[i], words[i], __ATOMIC_RELAXED);
+	}
+	__atomic_store_n(&shm->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+void ScopeTempShm::publishTemps(const double temp[4], const double when[4])
+{
+	int i;
+
+	if (!shm)
+		return;
+
+	for (i = 0; i < 4; i++) {
+		data.temp[i] = temp[i];
+		data.when[i] = when[i];
+	}
+	publish();
+}
+
+void ScopeTempShm::publishGuide(int n, int s, int w, int e)
+{
+	uint32_t guide = 0;
+
+	if (!shm)
+		return;
+
+	guide |= n ? ST_SHM_GUIDE_N : 0;
+	guide |= s ? ST_SHM_GUIDE_S : 0;
+	guide |= w ? ST_SHM_GUIDE_W : 0;
+	guide |= e ? ST_SHM_GUIDE_E : 0;
+
+	data.guide = guide;
+	data.guide_when = ScopeTempDevice::now();
+	publish();
+}
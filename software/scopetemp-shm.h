@@ -0,0 +1,91 @@
+#ifndef __SCOPETEMP_SHM_H
+#define __SCOPETEMP_SHM_H
+
+/* Live readings published by indi_scopetemp in POSIX shared memory, for
+   local consumers that don't want to go through the INDI server. Plain C
+   so anything can include it:
+
+	int fd = shm_open(ST_SHM_NAME, O_RDONLY, 0);
+	const struct st_shm *shm = mmap(NULL, sizeof(*shm), PROT_READ, MAP_SHARED, fd, 0);
+	struct st_shm copy;
+
+	st_shm_read(shm, &copy);
+
+   The writer never waits for readers; seq is odd while an update is in
+   progress and readers retry until they get a consistent copy. Both
+   sides move the block as 32 bit atomic words, so a reader racing the
+   writer sees stale or mixed words, never torn ones, and seq tells it
+   to try again. */
+
+#include <stdint.h>
+#include <string.h>
+
+#define ST_SHM_NAME    "/scopetemp"
+#define ST_SHM_MAGIC   0x48535453 /* "STSH" */
+#define ST_SHM_VERSION 1
+
+#define ST_SHM_GUIDE_N 0x01
+#define ST_SHM_GUIDE_S 0x02
+#define ST_SHM_GUIDE_W 0x04
+#define ST_SHM_GUIDE_E 0x08
+
+struct st_shm {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t seq;
+	uint32_t connected;
+
+	double temp[4];		/* C, NAN until the first sample */
+	double when[4];		/* last conversion in the mean, s since the epoch */
+
+	uint32_t guide;		/* ST_SHM_GUIDE_* outputs currently on */
+	uint32_t pad;
+	double guide_when;	/* last guide output change */
+
+	double updated;		/* last publication */
+};
+
+#define ST_SHM_WORDS (sizeof(struct st_shm) / sizeof(uint32_t))
+
+static inline void st_shm_read(const struct st_shm *shm, struct st_shm *copy)
+{
+	const uint32_t *src = (const uint32_t *) shm;
+	uint32_t words[ST_SHM_WORDS];
+	uint32_t s0, s1;
+	size_t i;
+
+	do {
+		s0 = __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE);
+		for (i = 0; i < ST_SHM_WORDS; i++)
+			words[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		s1 = __atomic_load_n(&shm->seq, __ATOMIC_RELAXED);
+	} while ((s0 & 1) || s0 != s1);
+
+	memcpy(copy, words, sizeof(*copy));
+}
+
+#ifdef __cplusplus
+
+/* the writer side */
+class ScopeTempShm {
+public:
+	ScopeTempShm();
+	~ScopeTempShm();
+
+	bool open(const char *name = ST_SHM_NAME);
+	void close();
+
+	void publishTemps(const double temp[4], const double when[4]);
+	void publishGuide(int n, int s, int w, int e);
+
+private:
+	void publish();
+
+	struct st_shm data;	// what the next publish() writes out
+	struct st_shm *shm;
+};
+
+#endif
+
+#endif
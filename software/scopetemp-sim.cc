@@ -0,0 +1,309 @@
+/* scopetemp-sim.cc -- virtual clock and simulated board */
+
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+
+#include <endian.h>
+
+#include "scopetemp-sim.h"
+
+VirtualClock::VirtualClock(double epoch)
+{
+	this->epoch = epoch;
+	t = 0;
+	seq = 0;
+	nfired = 0;
+	next_id = 1;
+}
+
+int VirtualClock::addTimer(int ms, void (*cb)(void *), void *p)
+{
+	key k(t + std::max(ms, 0) / 1000.0, seq++);
+	timer tm = { next_id++, cb, p };
+
+	queue[k] = tm;
+	ids[tm.id] = k;
+
+	return tm.id;
+}
+
+void VirtualClock::rmTimer(int id)
+{
+	std::map<int, key>::iterator i = ids.find(id);
+
+	if (i == ids.end())
+		return;
+
+	queue.erase(i->second);
+	ids.erase(i);
+}
+
+void VirtualClock::run(double until)
+{
+	while (!queue.empty() && queue.begin()->first.first <= until) {
+		std::map<key, timer>::iterator i = queue.begin();
+		timer tm = i->second;
+
+		if (t < i->first.first)
+			t = i->first.first;
+
+		ids.erase(tm.id);
+		queue.erase(i);
+
+		nfired++;
+		tm.cb(tm.p);
+	}
+
+	if (t < until)
+		t = until;
+}
+
+
+SimBoard::SimBoard(VirtualClock *clock, uint32_t seed)
+{
+	this->clock = clock;
+	caps = THERMAL_CAPS;
+	present = 0x0F;
+	latency = 0.0005;
+	jitter = 0.0002;
+	errors = 0;
+	spikes = 0;
+	spike = 0.02;
+	poll = 0.0006;
+
+	opened = false;
+	boot = clock->mono();
+	rng = seed ? seed : 1;
+
+	ntransfers = 0;
+	memset(nrequests, 0, sizeof(nrequests));
+	memset(nfailed, 0, sizeof(nfailed));
+	memset(read, 0, sizeof(read));
+	pwm[0] = pwm[1] = 0;
+	memset(heater, 0, sizeof(heater));
+
+	out = 0;
+	pulse_end[0] = pulse_end[1] = 0;
+	on_since[0] = on_since[1] = 0;
+}
+
+bool SimBoard::open(const char *path)
+{
+	opened = true;
+
+	return true;
+}
+
+void SimBoard::close()
+{
+	opened = false;
+}
+
+/* xorshift32, the same run for the same seed */
+double SimBoard::uniform()
+{
+	rng ^= rng << 13;
+	rng ^= rng >> 17;
+	rng ^= rng << 5;
+
+	return rng / 4294967296.0;
+}
+
+uint16_t SimBoard::frames(double t)
+{
+	return (uint16_t) (unsigned long) floor((t - boot) * 1000);
+}
+
+unsigned long SimBoard::conversions(double t)
+{
+	return (unsigned long) floor((t - boot) * 1000 / SIM_CONVERSION);
+}
+
+/* a night cooling off, a slow wobble, each sensor a bit off the others */
+double SimBoard::temperature(int id, double t)
+{
+	return 14.0 - 0.4 * (t / 3600) + 0.3 * sin(2 * M_PI * t / 1200) + 0.5 * id;
+}
+
+/* changes the outputs under mask, keeping the pulse log */
+void SimBoard::setOutputs(uint8_t bits, uint8_t mask, double t)
+{
+	int axis;
+
+	for (axis = 0; axis < 2; axis++) {
+		uint8_t m = mask & (axis == GUIDE_AXIS_DEC ? GUIDE_DEC_MASK : GUIDE_RA_MASK);
+		uint8_t was = out & m, is = bits & m;
+
+		if (!m || was == is)
+			continue;
+
+		if (was) {
+			pulse p = { axis, was, on_since[axis], t - on_since[axis] };
+			edges.push_back(p);
+		}
+		if (is)
+			on_since[axis] = t;
+	}
+
+	out = (out & ~mask) | (bits & mask);
+}
+
+void SimBoard::settle(double t)
+{
+	int axis;
+
+	for (axis = 0; axis < 2; axis++) {
+		double end = pulse_end[axis];
+
+		if (!end || end > t)
+			continue;
+
+		pulse_end[axis] = 0;
+		setOutputs(0, axis == GUIDE_AXIS_DEC ? GUIDE_DEC_MASK : GUIDE_RA_MASK, end);
+	}
+}
+
+int SimBoard::temps(int id, double t, unsigned char *data, uint16_t len)
+{
+	struct thermal_sample raw;
+	unsigned long k = conversions(t), j;
+	int32_t sum = 0;
+	int count;
+
+	memset(&raw, 0, sizeof(raw));
+	raw.now = htole16(frames(t));
+	raw.stamp = raw.now;
+
+	if (present & (1 << id)) {
+		count = std::min(k - read[id], 255UL);
+		for (j = k - count + 1; j <= k && count; j++)
+			sum += lround(temperature(id, boot + j * SIM_CONVERSION / 1000.0) * 16);
+		read[id] = k;
+
+		raw.sum = htole32(sum);
+		raw.count = count;
+		raw.seq = k ? (k - 1) % 255 + 1 : 0;
+		raw.stamp = htole16(frames(boot + k * SIM_CONVERSION / 1000.0));
+	}
+
+	len = std::min(len, (uint16_t) sizeof(raw));
+	memcpy(data, &raw, len);
+
+	return len;
+}
+
+int SimBoard::status(unsigned char *data, uint16_t len, double t)
+{
+	struct thermal_status raw;
+	int i, n = 0;
+
+	for (i = 0; i < 4; i++)
+		n += (present >> i) & 1;
+
+	memset(&raw, 0, sizeof(raw));
+	raw.max_gap = htole16(1500);	// 1 ms
+	raw.loops = htole16(12000);
+	raw.conversions = htole16((uint16_t) (conversions(t) * n));
+	raw.present = present;
+	raw.reset_cause = 1;		// power on
+	raw.boots = htole16(1);
+
+	len = std::min(len, (uint16_t) sizeof(raw));
+	memcpy(data, &raw, len);
+
+	return len;
+}
+
+int SimBoard::control(uint8_t type, uint8_t request, uint16_t value, uint16_t index,
+		      unsigned char *data, uint16_t len, unsigned int timeout)
+{
+	double dt, t;
+	uint8_t mask;
+	int axis, ret = 0;
+
+	if (!opened)
+		return LIBUSB_ERROR_NO_DEVICE;
+
+	dt = latency + jitter * uniform();
+	if (spikes > 0 && uniform() < spikes)
+		dt += spike;
+	t = clock->mono() + dt / 2;
+
+	settle(t);
+	ntransfers++;
+	nrequests[request & 15]++;
+
+	/* lost on the way, the board never hears of it */
+	if (errors > 0 && uniform() < errors) {
+		nfailed[request & 15]++;
+		clock->advance(dt);
+		return LIBUSB_ERROR_IO;
+	}
+
+	switch (request) {
+	case THERMAL_RQ_ECHO:
+		if (len >= 4) {
+			data[0] = value & 0xFF;
+			data[1] = value >> 8;
+			data[2] = index & 0xFF;
+			data[3] = index >> 8;
+			ret = 4;
+		}
+		break;
+
+	case THERMAL_RQ_TEMPS:
+		ret = temps(value & 3, t, data, len);
+		break;
+
+	case THERMAL_RQ_GUIDE:
+		pulse_end[0] = pulse_end[1] = 0;
+		setOutputs(value, GUIDE_MASK, t);
+		break;
+
+	case THERMAL_RQ_FANS:
+		pwm[0] = value;
+		pwm[1] = index;
+		break;
+
+	case THERMAL_RQ_HEATER:
+		heater[HEATER_CHANNEL(value)].cfg = value;
+		heater[HEATER_CHANNEL(value)].offset = htole16(index);
+		break;
+
+	case THERMAL_RQ_HEATER_GAINS:
+		heater[index & 1].kp = value & 0xFF;
+		heater[index & 1].ki = value >> 8;
+		break;
+
+	case THERMAL_RQ_HEATER_STATUS:
+		ret = std::min(len, (uint16_t) sizeof(heater[0]));
+		memcpy(data, &heater[value & 1], ret);
+		break;
+
+	/* off at the first look at the frame clock after the ms-th boundary,
+	   the main loop gets there anywhere up to poll later */
+	case THERMAL_RQ_PULSE:
+		axis = (value >> 8) & 1;
+		mask = axis == GUIDE_AXIS_DEC ? GUIDE_DEC_MASK : GUIDE_RA_MASK;
+		setOutputs(index ? value & mask : 0, mask, t);
+		pulse_end[axis] = index ? boot + (floor((t - boot) * 1000) + index) / 1000 + poll * uniform() : 0;
+		break;
+
+	case THERMAL_RQ_STATUS:
+		ret = status(data, len, t);
+		break;
+
+	case THERMAL_RQ_VERSION:
+		if (len >= sizeof(struct thermal_version)) {
+			struct thermal_version v = { THERMAL_PROTOCOL_VERSION, 0, htole16(caps) };
+			memcpy(data, &v, sizeof(v));
+			ret = sizeof(v);
+		}
+		break;
+	}
+
+	clock->advance(dt);
+
+	return ret;
+}
@@ -0,0 +1,133 @@
+#ifndef __SCOPETEMP_SIM_H
+#define __SCOPETEMP_SIM_H
+
+/* Virtual time and a simulated board, so the driver can be run through a
+   whole night in a few seconds, the same way every time. */
+
+#include <stdint.h>
+
+#include <map>
+#include <vector>
+
+#include "libscopetemp.h"
+
+/* Discrete event clock. Nothing moves unless run() or advance() says
+   so; timers due at the same time fire in the order they were added. */
+class VirtualClock : public ScopeTempClock {
+public:
+	VirtualClock(double epoch = 1500000000.0);
+
+	double mono() { return t; }
+	double now() { return epoch + t; }
+
+	int addTimer(int ms, void (*cb)(void *), void *p);
+	void rmTimer(int id);
+
+	/* time passing inside a call, a blocking transfer say. Timers
+	   that come due meanwhile fire late, as they would. */
+	void advance(double dt) { t += dt; }
+
+	/* fires everything due up to until, then sits there */
+	void run(double until);
+
+	unsigned long fired() { return nfired; }
+	bool pending() { return !queue.empty(); }
+
+private:
+	typedef std::pair<double, unsigned long> key; // due, order added
+
+	struct timer {
+		int id;
+		void (*cb)(void *);
+		void *p;
+	};
+
+	std::map<key, timer> queue;
+	std::map<int, key> ids;
+
+	double t, epoch;
+	unsigned long seq, nfired;
+	int next_id;
+};
+
+/* A protocol version 3 board on the far side of a USB link: DS1820s
+   converting every 750 ms on a slow drifting model, the frame clock,
+   guide outputs and timed pulses, heaters and the STATUS counters.
+   Every transfer takes latency (+ jitter) of virtual time and acts on
+   the board half way through. A bad link can be had too: a spike of
+   extra latency now and then, and transfers that never get there. */
+class SimBoard : public ScopeTempTransport {
+public:
+	SimBoard(VirtualClock *clock, uint32_t seed = 1);
+
+	/* the model, set before the driver opens it */
+	uint16_t caps;		// THERMAL_CAP_*, what VERSION says
+	uint8_t present;	// sensors on the bus
+	double latency;		// s per transfer
+	double jitter;		// s, uniform on top
+	double errors;		// fraction of transfers failing, LIBUSB_ERROR_IO
+	double spikes;		// fraction of transfers taking spike longer
+	double spike;		// s
+	double poll;		// s, most the main loop takes to look at the frame clock
+
+	bool open(const char *path);
+	void close();
+	bool isOpen() { return opened; }
+
+	int control(uint8_t type, uint8_t request, uint16_t value, uint16_t index,
+		    unsigned char *data, uint16_t len, unsigned int timeout);
+
+	const char *path() { return "sim"; }
+	const char *serial() { return "SIM00001"; }
+
+	/* guide outputs as the board drove them since clearPulses(),
+	   settle() closes the ones still running at t */
+	struct pulse {
+		int axis;
+		uint8_t bits;
+		double start;	// monotonic s
+		double length;	// s
+	};
+
+	void settle(double t);
+	const std::vector<pulse> &pulses() { return edges; }
+	void clearPulses() { edges.clear(); }
+
+	/* C, before the 1/16 rounding */
+	double temperature(int id, double t);
+
+	unsigned long transfers() { return ntransfers; }
+	unsigned long requests(int rq) { return nrequests[rq & 15]; }
+	unsigned long failed(int rq) { return nfailed[rq & 15]; }
+
+private:
+	static const int SIM_CONVERSION = 750; // milisec, a DS1820 conversion
+
+	VirtualClock *clock;
+	bool opened;
+	double boot;
+	uint32_t rng;
+
+	unsigned long ntransfers;
+	unsigned long nrequests[16];
+	unsigned long nfailed[16];
+
+	/* conversions since boot at the last read, per sensor */
+	unsigned long read[4];
+	uint16_t pwm[2];
+	struct thermal_heater heater[2];
+
+	uint8_t out;		// GUIDE_* outputs on
+	double pulse_end[2];	// 0 = no timed pulse
+	double on_since[2];
+	std::vector<pulse> edges;
+
+	double uniform();
+	uint16_t frames(double t);
+	unsigned long conversions(double t);
+	void setOutputs(uint8_t bits, uint8_t mask, double t);
+	int temps(int id, double t, unsigned char *data, uint16_t len);
+	int status(unsigned char *data, uint16_t len, double t);
+};
+
+#endif
@@ -0,0 +1,578 @@
+/* scopetemp-simulate.cc -- the INDI driver through a night against a
+   simulated board, in virtual time */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <vector>
+#include <deque>
+#include <algorithm>
+
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+
+#include "scopetemp.h"
+#include "scopetemp-sim.h"
+#include "scopetemp-record.h"
+#include "scopetemp-spans.h"
+
+static double wall()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage()
+{
+	fprintf(stderr,
+		"usage: scopetemp-simulate [options]\n"
+		"  -t hours     simulated session length (10, or the whole trace)\n"
+		"  -c sec       guide cadence (2), 0 for no guiding\n"
+		"  -l ms        transfer latency (0.5)\n"
+		"  -b ms        most the board's main loop takes to end a timed pulse (0.6)\n"
+		"  -s seed      (1)\n"
+		"  -H           host timed pulses, a board without THERMAL_CAP_PULSE\n"
+		"  -w file      record the transfers to a trace\n"
+		"  -r file      play a trace back instead of the simulated board\n"
+		"  -e file      event trace of the last spans, in virtual time\n"
+		"  -m           print the driver's metrics at the end\n"
+		"  -S           soak: manual moves, PWM changes and fast polling on top\n"
+		"               of guiding, over a bad link, failing on the limits below\n"
+		"  -E rate      soak transfer error rate (0.0005)\n"
+		"  -P ms        soak limit, 99th percentile guide latency and error (5)\n"
+		"  -M ms        soak limit, worst guide latency (100)\n"
+		"  -v           keep the driver's INDI output on stdout\n");
+	exit(2);
+}
+
+/* Guide pulses as asked for against what the board did. A board pulse
+   belongs to the last request on its axis before it started, a guide
+   request left without one is missing. Kept as it goes, so a soak runs
+   in constant memory. */
+static const int TALLY_BINS = 100000;	// of 10 us
+
+struct tally {
+	struct request {
+		double when;	// s
+		double length;	// ms, -1 for a manual move
+	};
+
+	std::deque<request> pending[2];
+	unsigned long n, missing;
+	double sum, sum2, min, max;	// length error, ms
+	double late_max;		// ms
+	std::vector<uint32_t> late;	// start latency
+	std::vector<uint32_t> off;	// |length error|
+};
+
+static void tally_init(struct tally *t)
+{
+	t->n = t->missing = 0;
+	t->sum = t->sum2 = 0;
+	t->min = 1e9;
+	t->max = -1e9;
+	t->late_max = 0;
+	t->late.assign(TALLY_BINS, 0);
+	t->off.assign(TALLY_BINS, 0);
+}
+
+static void tally_request(struct tally *t, int axis, double when, double length)
+{
+	struct tally::request r = { when, length };
+
+	t->pending[axis].push_back(r);
+}
+
+static int tally_bin(double ms)
+{
+	return std::max(0, std::min(TALLY_BINS - 1, (int) (ms * 100)));
+}
+
+/* takes the pulses off the board */
+static void tally_board(struct tally *t, SimBoard *board)
+{
+	size_t i;
+
+	for (i = 0; i < board->pulses().size(); i++) {
+		const SimBoard::pulse &p = board->pulses()[i];
+		std::deque<tally::request> &q = t->pending[p.axis];
+		struct tally::request r = { 0, -1 };
+		double err, late;
+
+		while (!q.empty() && q.front().when <= p.start) {
+			if (r.length >= 0)
+				t->missing++;
+			r = q.front();
+			q.pop_front();
+		}
+		if (r.length < 0)
+			continue;
+
+		err = p.length * 1000 - r.length;
+		late = (p.start - r.when) * 1000;
+
+		t->n++;
+		t->sum += err;
+		t->sum2 += err * err;
+		t->min = std::min(t->min, err);
+		t->max = std::max(t->max, err);
+		t->late_max = std::max(t->late_max, late);
+		t->late[tally_bin(late)]++;
+		t->off[tally_bin(fabs(err))]++;
+	}
+
+	board->clearPulses();
+}
+
+static void tally_finish(struct tally *t, SimBoard *board)
+{
+	int axis;
+
+	tally_board(t, board);
+
+	for (axis = 0; axis < 2; axis++) {
+		for (size_t i = 0; i < t->pending[axis].size(); i++)
+			t->missing += t->pending[axis][i].length >= 0;
+		t->pending[axis].clear();
+	}
+}
+
+/* ms, upper edge of the bin */
+static double percentile(const std::vector<uint32_t> &h, unsigned long n, double q)
+{
+	unsigned long k = (unsigned long) ceil(q * n), sum = 0;
+	int i;
+
+	for (i = 0; i < TALLY_BINS; i++) {
+		sum += h[i];
+		if (sum >= k)
+			break;
+	}
+
+	return (i + 1) / 100.0;
+}
+
+/* a guider asking for a random correction every cadence, axes in turn */
+struct guider {
+	ScopeTemp *drv;
+	VirtualClock *clock;
+	SimBoard *board;
+	struct tally *tally;
+	int cadence;		// ms, 0 = stopped
+	double due;		// of the next step
+	bool hold;		// guiding paused
+	uint32_t rng;
+	int axis;
+};
+
+static double uniform(uint32_t *rng)
+{
+	*rng ^= *rng << 13;
+	*rng ^= *rng >> 17;
+	*rng ^= *rng << 5;
+
+	return *rng / 4294967296.0;
+}
+
+static void guide_step(void *p)
+{
+	struct guider *g = (struct guider *) p;
+	static const char *prop[2] = { "TELESCOPE_TIMED_GUIDE_NS", "TELESCOPE_TIMED_GUIDE_EW" };
+	static const char *elem[2][2] = { { "TIMED_GUIDE_N", "TIMED_GUIDE_S" },
+					  { "TIMED_GUIDE_W", "TIMED_GUIDE_E" } };
+	double values[1];
+	char *names[1];
+	int dir;
+
+	if (!g->cadence)
+		return;
+
+	tally_board(g->tally, g->board);
+
+	if (!g->hold) {
+		values[0] = floor(20 + uniform(&g->rng) * 1480);
+		dir = uniform(&g->rng) < 0.5;
+		names[0] = (char *) elem[g->axis][dir];
+
+		/* from when it should have gone out, a busy loop counts */
+		tally_request(g->tally, g->axis, g->due, values[0]);
+		g->drv->ISNewNumber(g->drv->getDeviceName(), prop[g->axis], values, names, 1);
+
+		g->axis ^= 1;
+	}
+
+	g->clock->addTimer(g->cadence, guide_step, g);
+	g->due = g->clock->mono() + g->cadence / 1000.0;
+}
+
+/* The rest of a night around the guider, for a soak: new PWM duties
+   every minute, and every five a dither, a manual move with guiding
+   held around it. */
+struct load {
+	ScopeTemp *drv;
+	VirtualClock *clock;
+	struct guider *g;
+	uint32_t rng;
+	int step;
+	int axis;
+};
+
+static const int LOAD_STEP = 60000;	// milisec
+static const long ST_SOAK_RSS_GROWTH = 1024;	// kB
+
+static void load_release(void *p)
+{
+	struct load *l = (struct load *) p;
+
+	l->g->hold = false;
+}
+
+static void load_move(void *p, bool on)
+{
+	static const char *prop[2] = { "TELESCOPE_MOTION_NS", "TELESCOPE_MOTION_WE" };
+	static const char *elem[2][2] = { { "MOTION_NORTH", "MOTION_SOUTH" },
+					  { "MOTION_WEST", "MOTION_EAST" } };
+	struct load *l = (struct load *) p;
+	int dir = uniform(&l->rng) < 0.5;
+	ISState states[2] = { ISS_OFF, ISS_OFF };
+	char *names[2] = { (char *) elem[l->axis][0], (char *) elem[l->axis][1] };
+
+	if (on) {
+		states[dir] = ISS_ON;
+		tally_request(l->g->tally, l->axis, l->clock->mono(), -1);
+	}
+	l->drv->ISNewSwitch(l->drv->getDeviceName(), prop[l->axis], states, names, 2);
+}
+
+static void load_move_off(void *p)
+{
+	struct load *l = (struct load *) p;
+
+	load_move(p, false);
+	l->clock->addTimer(1000, load_release, l);
+}
+
+/* the last pulse has run out by now */
+static void load_move_on(void *p)
+{
+	struct load *l = (struct load *) p;
+
+	load_move(p, true);
+	l->clock->addTimer(lround(500 + uniform(&l->rng) * 2500), load_move_off, l);
+}
+
+static void load_step(void *p)
+{
+	struct load *l = (struct load *) p;
+	double values[2];
+	char *names[2] = { (char *) "PWM1", (char *) "PWM2" };
+
+	values[0] = floor(uniform(&l->rng) * 100);
+	values[1] = floor(uniform(&l->rng) * 100);
+	l->drv->ISNewNumber(l->drv->getDeviceName(), "PWM", values, names, 2);
+
+	if (++l->step % 5 == 0 && !l->g->hold) {
+		l->g->hold = true;
+		l->axis = uniform(&l->rng) < 0.5;
+		l->clock->addTimer(2000, load_move_on, l);
+	}
+
+	l->clock->addTimer(LOAD_STEP, load_step, l);
+}
+
+/* kB */
+static long rss()
+{
+	long pages = 0, resident = 0;
+	FILE *f = fopen("/proc/self/statm", "r");
+
+	if (f) {
+		if (fscanf(f, "%ld %ld", &pages, &resident) != 2)
+			resident = 0;
+		fclose(f);
+	}
+
+	return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static int fds()
+{
+	DIR *d = opendir("/proc/self/fd");
+	int n = 0;
+
+	if (!d)
+		return -1;
+	while (readdir(d))
+		n++;
+	closedir(d);
+
+	return n - 3;	// ., .. and d itself
+}
+
+/* per request, how long the transfers took when the trace was made */
+static void trace_summary(ScopeTempReplay &replay)
+{
+	unsigned long count[256] = { 0 }, fail[256] = { 0 };
+	double sum[256] = { 0 }, max[256] = { 0 }, d;
+	size_t i;
+	int rq;
+
+	for (i = 0; i < replay.records(); i++) {
+		const struct st_trace_record *r = replay.record(i);
+
+		if (r->type == 0)
+			continue;
+
+		d = r->duration / 1000.0;
+		count[r->request]++;
+		fail[r->request] += r->result < 0;
+		sum[r->request] += d;
+		if (d > max[r->request])
+			max[r->request] = d;
+	}
+
+	printf("trace        %zu records, %.2f h from %.3f\n", replay.records(), replay.length() / 3600, replay.start());
+	for (rq = 0; rq < 256; rq++)
+		if (count[rq])
+			printf("  request %-3d %8lu, mean %.3f max %.3f ms, %lu failed\n",
+			       rq, count[rq], sum[rq] / count[rq], max[rq], fail[rq]);
+}
+
+static void set_connected(ScopeTemp *drv, bool on)
+{
+	ISState states[2] = { on ? ISS_ON : ISS_OFF, on ? ISS_OFF : ISS_ON };
+	char *names[2] = { (char *) "CONNECT", (char *) "DISCONNECT" };
+
+	drv->ISNewSwitch(drv->getDeviceName(), "CONNECTION", states, names, 2);
+}
+
+int main(int argc, char *argv[])
+{
+	double hours = 0, cadence = 2, latency = 0.5, poll = 0.6, start, elapsed;
+	double error_rate = 0.0005, limit_p99 = 5, limit_max = 100, warmup;
+	double p99_late = 0, p99_off = 0;
+	bool verbose = false, host = false, show_metrics = false, soak = false, failed = false;
+	std::string metrics;
+	const char *record = NULL, *replay_file = NULL, *events = NULL;
+	uint32_t seed = 1;
+	int c, out = -1, fds0 = 0, fds1 = 0;
+	long rss0 = 0, rss1 = 0;
+	unsigned long lost;
+
+	while ((c = getopt(argc, argv, "t:c:l:b:s:Hw:r:e:mSE:P:M:v")) != -1) {
+		switch (c) {
+		case 't': hours = atof(optarg); break;
+		case 'c': cadence = atof(optarg); break;
+		case 'l': latency = atof(optarg); break;
+		case 'b': poll = atof(optarg); break;
+		case 's': seed = strtoul(optarg, NULL, 0); break;
+		case 'H': host = true; break;
+		case 'w': record = optarg; break;
+		case 'r': replay_file = optarg; break;
+		case 'e': events = optarg; break;
+		case 'm': show_metrics = true; break;
+		case 'S': soak = true; break;
+		case 'E': error_rate = atof(optarg); break;
+		case 'P': limit_p99 = atof(optarg); break;
+		case 'M': limit_max = atof(optarg); break;
+		case 'v': verbose = true; break;
+		default: usage();
+		}
+	}
+	if (hours < 0 || (cadence && cadence < 0.8) || (soak && (replay_file || !cadence)))
+		usage();
+
+	/* the driver talks INDI XML on stdout */
+	if (!verbose) {
+		fflush(stdout);
+		out = dup(1);
+		if (!freopen("/dev/null", "w", stdout))
+			return 1;
+	}
+
+	VirtualClock clock;
+	SimBoard board(&clock, seed);
+	ScopeTempReplay replay(&clock);
+	ScopeTempRecorder recorder;
+	ScopeTempTransport *transport = &board;
+	ScopeTemp drv;
+	struct tally tally;
+	struct guider g;
+	struct load l;
+
+	board.latency = latency / 1000;
+	board.jitter = latency / 1000 / 2;
+	board.poll = poll / 1000;
+	if (host)
+		board.caps &= ~THERMAL_CAP_PULSE;
+	if (soak) {
+		board.errors = error_rate;
+		board.spikes = 0.001;
+	}
+
+	if (replay_file) {
+		if (!replay.load(replay_file)) {
+			fprintf(stderr, "cannot read trace %s\n", replay_file);
+			return 1;
+		}
+		transport = &replay;
+		if (!hours)
+			hours = replay.length() / 3600;
+	}
+	if (!hours)
+		hours = 10;
+
+	if (record) {
+		if (!recorder.start(record, transport, &clock)) {
+			fprintf(stderr, "cannot write trace %s\n", record);
+			return 1;
+		}
+		transport = &recorder;
+	}
+
+	if (events) {
+		st_spans.setClock(&clock);
+		st_spans.enable(true);
+	}
+
+	tally_init(&tally);
+
+	drv.simulate(&clock, transport);
+	drv.ISGetProperties(NULL);
+	set_connected(&drv, true);
+
+	g.drv = &drv;
+	g.clock = &clock;
+	g.board = &board;
+	g.tally = &tally;
+	g.cadence = replay_file ? 0 : lround(cadence * 1000);	// a trace has its own
+	g.hold = false;
+	g.rng = seed;
+	g.axis = GUIDE_AXIS_DEC;
+	if (g.cadence) {
+		clock.addTimer(g.cadence, guide_step, &g);
+		g.due = clock.mono() + g.cadence / 1000.0;
+	}
+
+	if (soak) {
+		double periods[4] = { 2, 2, 2, 2 };
+		char *names[4] = { (char *) "T1", (char *) "T2", (char *) "T3", (char *) "T4" };
+
+		drv.ISNewNumber(drv.getDeviceName(), "TEMPERATURE_PERIOD", periods, names, 4);
+
+		l.drv = &drv;
+		l.clock = &clock;
+		l.g = &g;
+		l.rng = seed * 2654435761u;
+		l.step = 0;
+		l.axis = GUIDE_AXIS_DEC;
+		clock.addTimer(LOAD_STEP, load_step, &l);
+	}
+
+	/* memory and descriptors from after the first few minutes on, all
+	   allocated that's going to be unless something leaks */
+	start = wall();
+	if (soak) {
+		warmup = std::min(600., hours * 3600 / 10);
+		clock.run(warmup);
+		rss0 = rss();
+		fds0 = fds();
+	}
+	clock.run(hours * 3600);
+	elapsed = wall() - start;
+
+	/* let the last pulse finish */
+	if (g.cadence) {
+		g.cadence = 0;
+		clock.run(clock.mono() + 2);
+	}
+	if (soak) {
+		rss1 = rss();
+		fds1 = fds();
+	}
+	if (show_metrics)
+		drv.metrics(metrics);
+	set_connected(&drv, false);
+	recorder.stop();
+
+	if (events && !st_spans.dump(events))
+		fprintf(stderr, "cannot write %s\n", events);
+
+	if (out >= 0) {
+		fflush(stdout);
+		dup2(out, 1);
+		close(out);
+	}
+
+	if (show_metrics)
+		fputs(metrics.c_str(), stdout);
+
+	if (replay_file) {
+		printf("simulated    %.2f h in %.3f s wall\n", hours, elapsed);
+		printf("transfers    %lu replayed, %lu skipped, %lu missed\n",
+		       replay.replayed(), replay.skipped(), replay.missed());
+		trace_summary(replay);
+
+		return replay.missed() ? 1 : 0;
+	}
+
+	tally_finish(&tally, &board);
+	if (tally.n) {
+		p99_late = percentile(tally.late, tally.n, 0.99);
+		p99_off = percentile(tally.off, tally.n, 0.99);
+	}
+
+	printf("simulated    %.2f h in %.3f s wall, %.0fx\n", hours, elapsed, hours * 3600 / elapsed);
+	printf("timers       %lu\n", clock.fired());
+	printf("transfers    %lu (temps %lu, status %lu, echo %lu)\n", board.transfers(),
+	       board.requests(THERMAL_RQ_TEMPS), board.requests(THERMAL_RQ_STATUS),
+	       board.requests(THERMAL_RQ_ECHO));
+	printf("pulses       %lu, %s timed, %lu missing\n", tally.n, host ? "host" : "board", tally.missing);
+	if (tally.n) {
+		printf("pulse error  mean %.3f rms %.3f min %.3f max %.3f, 99%% within %.2f ms\n",
+		       tally.sum / tally.n, sqrt(tally.sum2 / tally.n), tally.min, tally.max, p99_off);
+		printf("guide late   median %.2f, 99%% %.2f, max %.3f ms\n",
+		       percentile(tally.late, tally.n, 0.5), p99_late, tally.late_max);
+	}
+
+	if (!soak)
+		return tally.missing ? 1 : 0;
+
+	/* a pulse whose transfer was lost is the only excuse for one missing */
+	lost = board.failed(THERMAL_RQ_PULSE) + board.failed(THERMAL_RQ_GUIDE);
+
+	printf("faults       %lu transfers lost, %lu of them guide\n",
+	       board.failed(THERMAL_RQ_ECHO) + board.failed(THERMAL_RQ_TEMPS) + board.failed(THERMAL_RQ_FANS) +
+	       board.failed(THERMAL_RQ_STATUS) + board.failed(THERMAL_RQ_HEATER_STATUS) + lost, lost);
+	printf("memory       %ld kB, %+ld after warmup\n", rss1, rss1 - rss0);
+	printf("descriptors  %d, %+d after warmup\n", fds1, fds1 - fds0);
+
+	if (tally.missing > lost) {
+		printf("FAIL: %lu pulses missing, %lu transfers lost\n", tally.missing, lost);
+		failed = true;
+	}
+	if (p99_late > limit_p99 || p99_off > limit_p99) {
+		printf("FAIL: 99%% guide latency %.2f, error %.2f ms, limit %.2f\n", p99_late, p99_off, limit_p99);
+		failed = true;
+	}
+	if (tally.late_max > limit_max) {
+		printf("FAIL: worst guide latency %.3f ms, limit %.2f\n", tally.late_max, limit_max);
+		failed = true;
+	}
+	if (rss1 - rss0 > ST_SOAK_RSS_GROWTH) {
+		printf("FAIL: resident memory grew %ld kB\n", rss1 - rss0);
+		failed = true;
+	}
+	if (fds1 != fds0) {
+		printf("FAIL: %+d file descriptors\n", fds1 - fds0);
+		failed = true;
+	}
+	printf("soak         %s\n", failed ? "FAILED" : "passed");
+
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,95 @@
+/* scopetemp-spans.cc -- span ring and Chrome trace event output */
+
+#include <cstdio>
+
+#include <time.h>
+#include <unistd.h>
+
+#include "scopetemp-spans.h"
+
+ScopeTempSpans st_spans;
+
+ScopeTempSpans::ScopeTempSpans()
+{
+	total = 0;
+	on = false;
+	clock = NULL;
+}
+
+void ScopeTempSpans::enable(bool on)
+{
+	if (on && !this->on)
+		total = 0;
+
+	this->on = on;
+}
+
+double ScopeTempSpans::mono()
+{
+	struct timespec ts;
+
+	if (clock)
+		return clock->mono();
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void ScopeTempSpans::add(const char *name, const char *cat, double start, int arg)
+{
+	struct span *s = &ring[total++ & (ST_SPANS - 1)];
+
+	s->start = start;
+	s->duration = mono() - start;
+	s->arg = arg;
+	s->name = name;
+	s->cat = cat;
+}
+
+/* "X" complete events in us, one thread: it all runs in the INDI loop */
+bool ScopeTempSpans::dump(const char *file)
+{
+	unsigned long i, first;
+	int pid = getpid();
+	FILE *f;
+
+	if (!(f = fopen(file, "w")))
+		return false;
+
+	first = total - kept();
+
+	fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":1,\"args\":{\"name\":\"%s\"}}",
+		pid, ST_PRODUCT);
+
+	for (i = first; i < total; i++) {
+		struct span *s = &ring[i & (ST_SPANS - 1)];
+
+		fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+			"\"pid\":%d,\"tid\":1,\"args\":{\"arg\":%d}}",
+			s->name, s->cat, s->start * 1e6, s->duration * 1e6, pid, s->arg);
+	}
+
+	fprintf(f, "\n]}\n");
+
+	return fclose(f) == 0;
+}
+
+const char *st_request_name(int request)
+{
+	switch (request) {
+	case THERMAL_RQ_ECHO:           return "ECHO";
+	case THERMAL_RQ_TEMPS:          return "TEMPS";
+	case THERMAL_RQ_GUIDE:          return "GUIDE";
+	case THERMAL_RQ_FANS:           return "FANS";
+	case THERMAL_RQ_HEATER:         return "HEATER";
+	case THERMAL_RQ_HEATER_GAINS:   return "HEATER_GAINS";
+	case THERMAL_RQ_HEATER_STATUS:  return "HEATER_STATUS";
+	case THERMAL_RQ_PULSE:          return "PULSE";
+	case THERMAL_RQ_STATUS:         return "STATUS";
+	case THERMAL_RQ_VERSION:        return "VERSION";
+	}
+
+	return "?";
+}
@@ -0,0 +1,82 @@
+#ifndef __SCOPETEMP_SPANS_H
+#define __SCOPETEMP_SPANS_H
+
+/* Where the time goes in the event loop: transfers, IDSet* calls, timer
+   callbacks and ISNew* handlers as spans in a ring, written out on
+   request as Chrome trace events (chrome://tracing, ui.perfetto.dev).
+   Nothing is allocated or written while recording, and a span costs a
+   branch when it's off. One ring per process, st_spans. */
+
+#include <stdint.h>
+
+#include "libscopetemp.h"
+
+class ScopeTempSpans {
+
+	static const int ST_SPANS = 16384; // power of 2
+
+public:
+	ScopeTempSpans();
+
+	void enable(bool on);
+	bool enabled() { return on; }
+
+	/* CLOCK_MONOTONIC unless told otherwise */
+	void setClock(ScopeTempClock *c) { clock = c; }
+	double mono();
+
+	/* name and cat have to stay around, string literals or property
+	   names */
+	void add(const char *name, const char *cat, double start, int arg);
+
+	/* oldest first, the ring stays as it is */
+	bool dump(const char *file);
+
+	/* since enable(), and of those still in the ring */
+	unsigned long count() { return total; }
+	unsigned long kept() { return total < (unsigned long) ST_SPANS ? total : ST_SPANS; }
+
+private:
+	struct span {
+		double start;	// s
+		float duration;	// s
+		int32_t arg;
+		const char *name;
+		const char *cat;
+	};
+
+	struct span ring[ST_SPANS];
+	unsigned long total;
+	bool on;
+	ScopeTempClock *clock;
+};
+
+extern ScopeTempSpans st_spans;
+
+/* the enclosing scope, as one span */
+class ScopeTempSpan {
+public:
+	ScopeTempSpan(const char *name, const char *cat, int arg = 0)
+	{
+		this->name = name;
+		this->cat = cat;
+		this->arg = arg;
+		start = st_spans.enabled() ? st_spans.mono() : -1;
+	}
+
+	~ScopeTempSpan()
+	{
+		if (start >= 0)
+			st_spans.add(name, cat, start, arg);
+	}
+
+private:
+	const char *name, *cat;
+	int arg;
+	double start;
+};
+
+/* THERMAL_RQ_* as text, "?" for the ones it doesn't know */
+const char *st_request_name(int request);
+
+#endif
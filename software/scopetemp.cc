@@ -3,8 +3,106 @@
 #include <cstring>
 #include <cmath>
 #include <memory>
+#include <algorithm>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cerrno>
+#include <cstdarg>
+
+#include <time.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "scopetemp.h"
+#include "scopetemp-spans.h"
+
+/* IDSet* with a span of its own, named after the property. INDI has no
+   va_list versions, so a message is formatted here first. */
+static const char *message(char *msg, size_t size, const char *fmt, va_list ap)
+{
+	if (!fmt)
+		return NULL;
+
+	vsnprintf(msg, size, fmt, ap);
+
+	return msg;
+}
+
+static void setNumber(INumberVectorProperty *p, const char *fmt = NULL, ...) __attribute__((format(printf, 2, 3)));
+static void setSwitch(ISwitchVectorProperty *p, const char *fmt = NULL, ...) __attribute__((format(printf, 2, 3)));
+static void setText(ITextVectorProperty *p, const char *fmt = NULL, ...) __attribute__((format(printf, 2, 3)));
+static void setBLOB(IBLOBVectorProperty *p, const char *fmt = NULL, ...) __attribute__((format(printf, 2, 3)));
+
+static void setNumber(INumberVectorProperty *p, const char *fmt, ...)
+{
+	ScopeTempSpan span(p->name, "IDSet");
+	char msg[512];
+	va_list ap;
+
+	va_start(ap, fmt);
+	IDSetNumber(p, fmt ? "%s" : NULL, message(msg, sizeof(msg), fmt, ap));
+	va_end(ap);
+}
+
+static void setSwitch(ISwitchVectorProperty *p, const char *fmt, ...)
+{
+	ScopeTempSpan span(p->name, "IDSet");
+	char msg[512];
+	va_list ap;
+
+	va_start(ap, fmt);
+	IDSetSwitch(p, fmt ? "%s" : NULL, message(msg, sizeof(msg), fmt, ap));
+	va_end(ap);
+}
+
+static void setText(ITextVectorProperty *p, const char *fmt, ...)
+{
+	ScopeTempSpan span(p->name, "IDSet");
+	char msg[512];
+	va_list ap;
+
+	va_start(ap, fmt);
+	IDSetText(p, fmt ? "%s" : NULL, message(msg, sizeof(msg), fmt, ap));
+	va_end(ap);
+}
+
+static void setBLOB(IBLOBVectorProperty *p, const char *fmt, ...)
+{
+	ScopeTempSpan span(p->name, "IDSet");
+	char msg[512];
+	va_list ap;
+
+	va_start(ap, fmt);
+	IDSetBLOB(p, fmt ? "%s" : NULL, message(msg, sizeof(msg), fmt, ap));
+	va_end(ap);
+}
+
+static const char *DIAG_TAB = "Diagnostics";
+static const char *HEATER_TAB = "Dew heaters";
+
+/* the real one, INDI's event loop */
+class IndiClock : public ScopeTempClock {
+public:
+	double mono()
+	{
+		struct timespec ts;
+
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+
+		return ts.tv_sec + ts.tv_nsec / 1e9;
+	}
+
+	double now() { return ScopeTempDevice::now(); }
+
+	int addTimer(int ms, void (*cb)(void *), void *p) { return IEAddTimer(ms, cb, p); }
+	void rmTimer(int id) { IERmTimer(id); }
+};
+
+static IndiClock indiClock;
 
 static ScopeTemp *scopeTemp = new ScopeTemp();
 
@@ -50,10 +148,45 @@ void ISSnoopDevice (XMLEle *root)
 
 ScopeTemp::ScopeTemp()
 {
-	usb_handle = NULL;
-	_timerNS = _timerEW = 0;
-	_guideN = _guideS = _guideE = _guideW = 0;
+	_clock = &indiClock;
+	_sim = false;
+	memset(_timerGuide, 0, sizeof(_timerGuide));
+	memset(_guide, 0, sizeof(_guide));
 	_timerTemp = 0;
+	memset(_tempSeq, 0, sizeof(_tempSeq));
+	_timerStatus = 0;
+	_timerBeat = 0;
+	_beats = 0;
+	_lost = false;
+	_statusValid = false;
+	_ccdReadout = false;
+	_ccdReadoutSince = 0;
+	_edge[0] = _edge[1] = 0;
+	_pollNext = _pollFresh = 0;
+	_pending = 0;
+	_timerOutputs = 0;
+	_jitterCount = 0;
+	for (int i = 0; i < 4; i++)
+		_tempDue[i] = 0;
+	_heaterDue = 0;
+	_timerStream = 0;
+	_lastDisplay = 0;
+	_stream.header.count = 0;
+	_timerBurst = 0;
+	_burstEnd = 0;
+	_burst.header.count = 0;
+	_present = 0x0F;
+	for (int i = 0; i < 4; i++)
+		_tempMember[i] = i;
+	memset(_temp, 0, sizeof(_temp));
+	memset(&_state, 0, sizeof(_state));
+	_state.present = 0x0F;
+	_state.heater[0] = _state.heater[1] = -1;
+	_startMark = mono();
+	_startPending = false;
+	memset(_pulses, 0, sizeof(_pulses));
+	memset(_pulseTime, 0, sizeof(_pulseTime));
+	_reconnects = _resets = 0;
 }
 
 ScopeTemp::~ScopeTemp()
@@ -61,103 +194,401 @@ ScopeTemp::~ScopeTemp()
 	Disconnect();
 }
 
+void ScopeTemp::simulate(ScopeTempClock *clock, ScopeTempTransport *transport)
+{
+	_clock = clock;
+	_sim = true;
+
+	device.setClock(clock);
+	device.setTransport(transport);
+
+	_startMark = mono();
+}
+
 
-bool ScopeTemp::getTemperature(int id, double *temp)
+/* median and median absolute deviation, v is reordered */
+static void median_mad(std::vector<double> &v, double *median, double *mad)
 {
-	uint8_t buffer[4];
+	size_t i, mid = v.size() / 2;
 
-	if (!usb_handle || libusb_control_transfer(usb_handle, ST_READ, ST_REQUEST_TEMP, id, 0, buffer, 4, 0) != 4)
-		return false;
+	std::nth_element(v.begin(), v.begin() + mid, v.end());
+	*median = v[mid];
 
-	*temp = (((int8_t) buffer[1] << 8) + (buffer[0] & 0xFE)) / 2.0 - 0.25 + (buffer[3] - buffer[2]) / (1.0 * buffer[3]);
+	for (i = 0; i < v.size(); i++)
+		v[i] = fabs(v[i] - *median);
 
-	return true;
+	std::nth_element(v.begin(), v.begin() + mid, v.end());
+	*mad = v[mid];
 }
 
-bool ScopeTemp::setPWM(int pwm1, int pwm2)
+/* Time echo round trips and guide writes. The guide writes switch all
+   outputs off, which is where we want them after a connect anyway. */
+void ScopeTemp::calibrateLatency()
 {
-	if (!usb_handle || libusb_control_transfer(usb_handle, ST_WRITE, ST_REQUEST_PWM, pwm1, pwm2, NULL, 0, 0) != 0)
-		return false;
+	std::vector<double> echo, write;
+	double t0;
+	int i;
 
-	return true;
+	for (i = 0; i < ST_CAL_ROUNDS; i++) {
+		t0 = mono();
+		if (device.echo(i, ~i))
+			echo.push_back((mono() - t0) * 1000);
+
+		t0 = mono();
+		if (device.setGuiding(0, 0, 0, 0))
+			write.push_back((mono() - t0) * 1000);
+	}
+
+	if (echo.size())
+		median_mad(echo, &LatencyN[0].value, &LatencyN[1].value);
+	if (write.size())
+		median_mad(write, &LatencyN[2].value, &LatencyN[3].value);
+
+	LatencyNP.s = (echo.size() && write.size()) ? IPS_OK : IPS_ALERT;
 }
 
-bool ScopeTemp::setGuiding(int n, int s, int w, int e)
+/* how late the event loop fires our stop timers, smoothed and kept for
+   the jitter figures. Runs on the guide path, so no allocation. */
+void ScopeTemp::timerLate(double late)
+{
+	LatencyN[4].value += (late * 1000 - LatencyN[4].value) / 8;
+
+	_jitter[_jitterCount % ST_JITTER_SAMPLES] = late * 1000;
+	_jitterCount++;
+}
+
+void ScopeTemp::updateJitter()
+{
+	int i, n = std::min(_jitterCount, (int) ST_JITTER_SAMPLES);
+	double sum = 0, max = 0;
+
+	for (i = 0; i < n; i++) {
+		_jitterSorted[i] = _jitter[i];
+		sum += _jitter[i];
+		max = std::max(max, _jitter[i]);
+	}
+
+	JitterN[0].value = _jitterCount;
+	JitterN[1].value = n ? sum / n : 0;
+	JitterN[3].value = max;
+
+	if (n) {
+		i = (n * 99) / 100;
+		std::nth_element(_jitterSorted, _jitterSorted + i, _jitterSorted + n);
+		JitterN[2].value = _jitterSorted[i];
+	} else {
+		JitterN[2].value = 0;
+	}
+
+	setNumber(&JitterNP);
+}
+
+/* what real-time mode pre-faults, bytes */
+static const int PREFAULT_STACK = 256 * 1024;
+static const int PREFAULT_HEAP = 4 * 1024 * 1024;
+
+static void prefault_stack()
+{
+	volatile char stack[PREFAULT_STACK];
+	int i;
+
+	for (i = 0; i < (int) sizeof(stack); i += 4096)
+		stack[i] = stack[i];
+}
+
+/* glibc can't tell what its malloc settings are, only take new ones, so
+   real-time off puts back its documented defaults, or whatever the
+   MALLOC_*_ environment asked for. The trim threshold stays fixed from
+   then on, glibc only adjusts it while nobody has ever set it. */
+static const int MALLOC_TRIM_DEFAULT = 128 * 1024;
+static const int MALLOC_MMAP_DEFAULT = 65536;
+
+static bool heap_pinned;
+
+static int malloc_default(const char *env, int value)
+{
+	const char *s = getenv(env);
+
+	return s && *s ? atoi(s) : value;
+}
+
+static void pin_heap(bool on)
 {
-	uint8_t val = 0;
+	if (on == heap_pinned)
+		return;
+
+	if (on) {
+		mallopt(M_TRIM_THRESHOLD, -1);
+		mallopt(M_MMAP_MAX, 0);
+	} else {
+		mallopt(M_TRIM_THRESHOLD, malloc_default("MALLOC_TRIM_THRESHOLD_", MALLOC_TRIM_DEFAULT));
+		mallopt(M_MMAP_MAX, malloc_default("MALLOC_MMAP_MAX_", MALLOC_MMAP_DEFAULT));
+	}
+	heap_pinned = on;
+}
+
+/* The driver is one thread, the INDI event loop does USB and guide timing
+   both, so that is what gets SCHED_FIFO. Locking and pre-faulting keeps page
+   faults off the guide path; freed memory stays in the heap until it's
+   switched off again. */
+bool ScopeTemp::setRealtime(bool on)
+{
+	struct sched_param sp;
+	int policy = on ? SCHED_FIFO : SCHED_OTHER;
+	char *heap;
+	int i;
+
+	sp.sched_priority = on ? (int) RtPrioN[0].value : 0;
+	if ((errno = pthread_setschedparam(pthread_self(), policy, &sp)))
+		return false;
 
-	val |= n ? (1 << 1) : 0; // dec+
-	val |= s ? (1 << 4) : 0; // dec-
-	val |= w ? (1 << 3) : 0; // ra+
-	val |= e ? (1 << 5) : 0; // ra-
+	if (!on) {
+		pin_heap(false);
+		munlockall();
+		return true;
+	}
 
-	if (!usb_handle || libusb_control_transfer(usb_handle, ST_WRITE, ST_REQUEST_GUIDE, val, 0, NULL, 0, 0) != 0)
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+		sp.sched_priority = 0;
+		pthread_setschedparam(pthread_self(), SCHED_OTHER, &sp);
 		return false;
+	}
+
+	pin_heap(true);
+
+	prefault_stack();
+
+	heap = (char *) malloc(PREFAULT_HEAP);
+	if (heap) {
+		for (i = 0; i < PREFAULT_HEAP; i += 4096)
+			heap[i] = 0;
+		free(heap);
+	}
 
 	return true;
 }
 
-bool ScopeTemp::Connect()
+/* The device switches an output when the SETUP stage of a guide write lands,
+   about half a write round trip after the call starts; the status stage
+   takes the other half. The stop timer is armed once the start write has
+   returned, so the start edge was half a round trip before that, and the
+   stop edge will come half a round trip plus the timer lateness after the
+   timer fires. */
+double ScopeTemp::guideDelay(double duration)
 {
-	libusb_device **devices, *dev;
-	libusb_device_descriptor desc;
-	libusb_device_handle *handle;
-	int i, n;
-	uint32_t devID;
-	char manufacturer[32], product[32];
+	if (CompS[0].s != ISS_ON)
+		return floor(duration);
 
-	if (usb_handle)
-		return true;
+	return std::max(0., duration - LatencyN[2].value - LatencyN[4].value);
+}
 
-	libusb_init(NULL);
+bool ScopeTemp::Connect()
+{
+	int i, ch;
 
-	n = libusb_get_device_list(NULL, &devices);
-	for (i = 0; i < n; i++) {
-		dev = devices[i];
-		if (libusb_get_device_descriptor(dev, &desc) < 0)
-			continue;
+	if (!_startMark)
+		_startMark = mono();
 
-		/* voti.nl USB VID/PID for vendor class devices */
-		devID = (desc.idVendor << 16) + desc.idProduct;
-		if (devID != 0x16C005DC)
-			continue;
+	if (!_sim)
+		loadState();
 
-		if (libusb_open(dev, &handle) < 0)
-			continue;
+	if (!device.open(_state.path))
+		return false;
 
-		if ((libusb_get_string_descriptor_ascii(handle, desc.iManufacturer, (unsigned char *) manufacturer, 32) < 0) ||
-		    (libusb_get_string_descriptor_ascii(handle, desc.iProduct, (unsigned char *) product, 32) < 0)) {
-			libusb_close(handle);
-			continue;
-		}
+	if (device.version() < THERMAL_PROTOCOL_VERSION)
+		IDMessage(getDeviceName(), "Protocol version %d board, some features are off", device.version());
 
-		if (strcmp(manufacturer, ST_MANUFACTURER) || strcmp(product, ST_PRODUCT)) {
-			libusb_close(handle);
+	/* the same board as last time keeps its calibration */
+	if (!strcmp(_state.path, device.path()) && !strcmp(_state.serial, device.serial()) && _state.latency[0]) {
+		for (i = 0; i < 4; i++)
+			LatencyN[i].value = _state.latency[i];
+		LatencyNP.s = IPS_OK;
+		device.setGuiding(0, 0, 0, 0);
+		setPresent(_state.present);
+	} else {
+		calibrateLatency();
+		setPresent(0x0F);
+	}
+
+	for (ch = 0; ch < 2; ch++) {
+		if (_state.heater[ch] < 0)
 			continue;
-		}
+		HeaterS[ch].s = _state.heater[ch] ? ISS_ON : ISS_OFF;
+		for (i = 0; i < 5; i++)
+			HeaterN[ch][i].value = _state.loop[ch][i];
+	}
 
-		/* found it, keep open */
-		usb_handle = handle;
-		break;
+	/* outputs back as they were, the loops first as in flushOutputs */
+	if (device.hasCap(THERMAL_CAP_HEATER)) {
+		HeaterSP.s = pushHeater(0) && pushHeater(1) ? IPS_OK : IPS_ALERT;
+		HeaterNP[0].s = HeaterNP[1].s = HeaterSP.s;
 	}
+	PWMN[0].value = _state.pwm[0];
+	PWMN[1].value = _state.pwm[1];
+	PWMNP.s = device.setPWM((PWMN[0].value / 100.0) * 65535, (PWMN[1].value / 100.0) * 65535) ? IPS_OK : IPS_ALERT;
+
+	saveState();
 
-	libusb_free_device_list(devices, 1);
+	/* local consumers are a bonus, carry on without them */
+	if (!_sim)
+		shm.open();
 
-	return usb_handle ? true : false;
+	StartN[0].value = mono() - _startMark;
+	StartN[1].value = 0;
+	_startPending = true;
+
+	return true;
 }
 
 bool ScopeTemp::Disconnect()
 {
-	if (usb_handle)
-		libusb_close(usb_handle);
+	saveState();
+
+	if (_record.recording()) {
+		setTrace("");
+		IUSaveText(&TraceT[0], "");
+		TraceTP.s = IPS_IDLE;
+	}
+
+	shm.close();
+	device.close();
+
+	memset(_tempSeq, 0, sizeof(_tempSeq));
+	_statusValid = false;
+	_startMark = 0;
+	_startPending = false;
+
+	return true;
+}
+
+/* an empty name stops, a new one starts over */
+bool ScopeTemp::setTrace(const char *file)
+{
+	if (device.getTransport() == &_record)
+		device.setTransport(_record.wrapped());
+	_record.stop();
+
+	if (!file || !file[0])
+		return true;
 
-	usb_handle = NULL;
+	if (!_record.start(file, device.getTransport(), _clock))
+		return false;
 
-	libusb_exit(NULL);
+	device.setTransport(&_record);
 
 	return true;
 }
 
+static void state_file(const char *device, char *file, int len)
+{
+	const char *home = getenv("HOME");
+
+	if (!home) {
+		file[0] = 0;
+		return;
+	}
+
+	snprintf(file, len, "%s/.indi/%s_state", home, device);
+}
+
+/* a missing or odd file leaves the defaults, a full scan and calibration */
+void ScopeTemp::loadState()
+{
+	char file[256], line[128], key[16], value[64];
+	double loop[5];
+	FILE *f;
+	int ch, on;
+
+	state_file(getDeviceName(), file, sizeof(file));
+	if (!file[0] || !(f = fopen(file, "r")))
+		return;
+
+	while (fgets(line, sizeof(line), f)) {
+		value[0] = 0;
+		if (sscanf(line, "%15s %63s", key, value) < 1)
+			continue;
+
+		if (!strcmp(key, "path"))
+			snprintf(_state.path, sizeof(_state.path), "%s", value);
+		else if (!strcmp(key, "serial"))
+			snprintf(_state.serial, sizeof(_state.serial), "%s", value);
+		else if (!strcmp(key, "pwm"))
+			sscanf(line, "%*s %lf %lf", &_state.pwm[0], &_state.pwm[1]);
+		else if (!strcmp(key, "present"))
+			_state.present = strtol(value, NULL, 0) & 0x0F;
+		else if (!strcmp(key, "latency"))
+			sscanf(line, "%*s %lf %lf %lf %lf", &_state.latency[0], &_state.latency[1],
+			       &_state.latency[2], &_state.latency[3]);
+		else if (!strcmp(key, "heater") &&
+			 sscanf(line, "%*s %d %d %lf %lf %lf %lf %lf", &ch, &on,
+				&loop[0], &loop[1], &loop[2], &loop[3], &loop[4]) == 7 &&
+			 (ch == 0 || ch == 1)) {
+			_state.heater[ch] = on != 0;
+			memcpy(_state.loop[ch], loop, sizeof(loop));
+		}
+	}
+
+	fclose(f);
+}
+
+/* written to the side and renamed, never half there */
+void ScopeTemp::saveState()
+{
+	char file[256], tmp[264];
+	FILE *f;
+
+	if (_sim)
+		return;
+
+	if (device.isOpen()) {
+		snprintf(_state.path, sizeof(_state.path), "%s", device.path());
+		snprintf(_state.serial, sizeof(_state.serial), "%s", device.serial());
+		_state.pwm[0] = PWMN[0].value;
+		_state.pwm[1] = PWMN[1].value;
+		_state.present = _present;
+		if (LatencyNP.s == IPS_OK)
+			for (int i = 0; i < 4; i++)
+				_state.latency[i] = LatencyN[i].value;
+		for (int ch = 0; ch < 2; ch++) {
+			_state.heater[ch] = HeaterS[ch].s == ISS_ON;
+			for (int i = 0; i < 5; i++)
+				_state.loop[ch][i] = HeaterN[ch][i].value;
+		}
+	}
+
+	state_file(getDeviceName(), file, sizeof(file));
+	if (!file[0])
+		return;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", file);
+	if (!(f = fopen(tmp, "w"))) {
+		/* first run, INDI hasn't made it yet */
+		snprintf(tmp, sizeof(tmp), "%s/.indi", getenv("HOME"));
+		mkdir(tmp, 0755);
+		snprintf(tmp, sizeof(tmp), "%s.tmp", file);
+		if (!(f = fopen(tmp, "w")))
+			return;
+	}
+
+	fprintf(f, "path %s\n", _state.path);
+	if (_state.serial[0])
+		fprintf(f, "serial %s\n", _state.serial);
+	fprintf(f, "pwm %.2f %.2f\n", _state.pwm[0], _state.pwm[1]);
+	fprintf(f, "present 0x%x\n", _state.present);
+	fprintf(f, "latency %.4f %.4f %.4f %.4f\n", _state.latency[0], _state.latency[1],
+		_state.latency[2], _state.latency[3]);
+	for (int ch = 0; ch < 2; ch++)
+		if (_state.heater[ch] >= 0)
+			fprintf(f, "heater %d %d %.f %.f %.2f %.f %.f\n", ch, _state.heater[ch],
+				_state.loop[ch][0], _state.loop[ch][1], _state.loop[ch][2],
+				_state.loop[ch][3], _state.loop[ch][4]);
+
+	if (fclose(f) == 0)
+		rename(tmp, file);
+	else
+		remove(tmp);
+}
+
 bool ScopeTemp::initProperties()
 {
 	INDI::DefaultDevice::initProperties();
@@ -168,25 +599,167 @@ bool ScopeTemp::initProperties()
 	IUFillNumber(&TempN[3], "T4", "T4 (C)", "%5.2f", -55., 125., 0., 0.);
 	IUFillNumberVector(&TempNP, TempN, 4, getDeviceName(), "TEMPERATURE", "Temperatures", MAIN_CONTROL_TAB, IP_RO, 60, IPS_IDLE);
 
+	IUFillNumber(&PeriodN[0], "T1", "T1 (s)", "%.f", 1., 3600., 1., ST_TEMP_POLL_INTERVAL / 1000);
+	IUFillNumber(&PeriodN[1], "T2", "T2 (s)", "%.f", 1., 3600., 1., ST_TEMP_POLL_INTERVAL / 1000);
+	IUFillNumber(&PeriodN[2], "T3", "T3 (s)", "%.f", 1., 3600., 1., ST_TEMP_POLL_INTERVAL / 1000);
+	IUFillNumber(&PeriodN[3], "T4", "T4 (s)", "%.f", 1., 3600., 1., ST_TEMP_POLL_INTERVAL / 1000);
+	IUFillNumberVector(&PeriodNP, PeriodN, 4, getDeviceName(), "TEMPERATURE_PERIOD", "Sample periods", MAIN_CONTROL_TAB, IP_RW, 60, IPS_IDLE);
+
+	IUFillSwitch(&StreamS[0], "ENABLE", "On", ISS_OFF);
+	IUFillSwitch(&StreamS[1], "DISABLE", "Off", ISS_ON);
+	IUFillSwitchVector(&StreamSP, StreamS, 2, getDeviceName(), "TEMPERATURE_STREAM_MODE", "Sample stream", MAIN_CONTROL_TAB, IP_RW, ISR_1OFMANY, 0, IPS_IDLE);
+
+	IUFillNumber(&StreamN[0], "CADENCE", "Block every (s)", "%.f", 1., 3600., 1., 10.);
+	IUFillNumber(&StreamN[1], "DISPLAY", "Numbers every (s)", "%.f", 0., 3600., 1., 10.);
+	IUFillNumberVector(&StreamNP, StreamN, 2, getDeviceName(), "TEMPERATURE_STREAM_SETTINGS", "Stream settings", MAIN_CONTROL_TAB, IP_RW, 60, IPS_IDLE);
+
+	IUFillBLOB(&StreamB[0], "SAMPLES", "Samples", ST_BLOCK_FORMAT);
+	IUFillBLOBVector(&StreamBP, StreamB, 1, getDeviceName(), "TEMPERATURE_STREAM", "Sample blocks", MAIN_CONTROL_TAB, IP_RO, 60, IPS_IDLE);
+
+	IUFillNumber(&BurstN[0], "DURATION", "Duration (s)", "%.f", 1., 600., 1., 60.);
+	IUFillNumberVector(&BurstNP, BurstN, 1, getDeviceName(), "TEMPERATURE_BURST", "Burst capture", MAIN_CONTROL_TAB, IP_RW, 60, IPS_IDLE);
+
+	IUFillBLOB(&BurstB[0], "SAMPLES", "Samples", ST_BLOCK_FORMAT);
+	IUFillBLOBVector(&BurstBP, BurstB, 1, getDeviceName(), "TEMPERATURE_BURST_DATA", "Burst samples", MAIN_CONTROL_TAB, IP_RO, 60, IPS_IDLE);
+
+	/* when the last conversion in each mean was made, the window ends there */
+	IUFillNumber(&TempTimeN[0], "T1", "T1 (s)", "%.3f", 0., 1e10, 0., 0.);
+	IUFillNumber(&TempTimeN[1], "T2", "T2 (s)", "%.3f", 0., 1e10, 0., 0.);
+	IUFillNumber(&TempTimeN[2], "T3", "T3 (s)", "%.3f", 0., 1e10, 0., 0.);
+	IUFillNumber(&TempTimeN[3], "T4", "T4 (s)", "%.3f", 0., 1e10, 0., 0.);
+	IUFillNumberVector(&TempTimeNP, TempTimeN, 4, getDeviceName(), "TEMPERATURE_TIME", "Last conversion", MAIN_CONTROL_TAB, IP_RO, 60, IPS_IDLE);
+
+	IUFillNumber(&DiagN[0], "LOOP_RATE", "Main loop (Hz)", "%.f", 0., 65535., 0., 0.);
+	IUFillNumber(&DiagN[1], "POLL_GAP_MAX", "Max usbPoll gap (ms)", "%.2f", 0., 40., 0., 0.);
+	IUFillNumber(&DiagN[2], "CONVERSIONS", "Conversions", "%.f", 0., 1e12, 0., 0.);
+	IUFillNumber(&DiagN[3], "RESET_ERR_T1", "T1 reset failures", "%.f", 0., 1e12, 0., 0.);
+	IUFillNumber(&DiagN[4], "RESET_ERR_T2", "T2 reset failures", "%.f", 0., 1e12, 0., 0.);
+	IUFillNumber(&DiagN[5], "RESET_ERR_T3", "T3 reset failures", "%.f", 0., 1e12, 0., 0.);
+	IUFillNumber(&DiagN[6], "RESET_ERR_T4", "T4 reset failures", "%.f", 0., 1e12, 0., 0.);
+	IUFillNumber(&DiagN[7], "CRC_ERR_T1", "T1 CRC failures", "%.f", 0., 1e12, 0., 0.);
+	IUFillNumber(&DiagN[8], "CRC_ERR_T2", "T2 CRC failures", "%.f", 0., 1e12, 0., 0.);
+	IUFillNumber(&DiagN[9], "CRC_ERR_T3", "T3 CRC failures", "%.f", 0., 1e12, 0., 0.);
+	IUFillNumber(&DiagN[10], "CRC_ERR_T4", "T4 CRC failures", "%.f", 0., 1e12, 0., 0.);
+	IUFillNumber(&DiagN[11], "BOOTS", "Boots", "%.f", 0., 65535., 0., 0.);
+	IUFillNumber(&DiagN[12], "RESET_CAUSE", "Last reset cause (MCUSR)", "%.f", 0., 255., 0., 0.);
+	IUFillNumberVector(&DiagNP, DiagN, 13, getDeviceName(), "DIAGNOSTICS", "Device health", DIAG_TAB, IP_RO, 60, IPS_IDLE);
+
+	IUFillNumber(&StartN[0], "CONNECTED", "Connected (s)", "%.3f", 0., 1e6, 0., 0.);
+	IUFillNumber(&StartN[1], "FIRST_SAMPLE", "First sample (s)", "%.3f", 0., 1e6, 0., 0.);
+	IUFillNumberVector(&StartNP, StartN, 2, getDeviceName(), "STARTUP_TIME", "Since start", DIAG_TAB, IP_RO, 60, IPS_IDLE);
+
 	IUFillNumber(&PWMN[0], "PWM1", "PWM1 (%)", "%.f", 0., 100., 1., 0.);
 	IUFillNumber(&PWMN[1], "PWM2", "PWM2 (%)", "%.f", 0., 100., 1., 0.);
 	IUFillNumberVector(&PWMNP, PWMN, 2, getDeviceName(), "PWM", "PWM Control", MAIN_CONTROL_TAB, IP_RW, 60, IPS_IDLE);
 
-	IUFillSwitch(&MoveNSS[0], "MOTION_NORTH", "Guide N", ISS_OFF);
-	IUFillSwitch(&MoveNSS[1], "MOTION_SOUTH", "Guide S", ISS_OFF);
-	IUFillSwitchVector(&MoveNSSP, MoveNSS, 2, getDeviceName(), "TELESCOPE_MOTION_NS", "DEC", GUIDE_TAB, IP_RW, ISR_ATMOST1, 0, IPS_IDLE);
+	IUFillSwitch(&HeaterS[0], "HEATER1", "PWM1 auto", ISS_OFF);
+	IUFillSwitch(&HeaterS[1], "HEATER2", "PWM2 auto", ISS_OFF);
+	IUFillSwitchVector(&HeaterSP, HeaterS, 2, getDeviceName(), "HEATER_AUTO", "Heater control", HEATER_TAB, IP_RW, ISR_NOFMANY, 0, IPS_IDLE);
+
+	for (int ch = 0; ch < 2; ch++) {
+		char name[MAXINDINAME], label[MAXINDILABEL];
+
+		IUFillNumber(&HeaterN[ch][0], "SENSOR", "Heated sensor", "%.f", 1., 4., 1., 1.);
+		IUFillNumber(&HeaterN[ch][1], "REFERENCE", "Reference sensor", "%.f", 1., 4., 1., 2.);
+		IUFillNumber(&HeaterN[ch][2], "OFFSET", "Above reference (C)", "%.2f", -20., 20., 0.25, 3.);
+		IUFillNumber(&HeaterN[ch][3], "KP", "Kp", "%.f", 0., 255., 1., 32.);
+		IUFillNumber(&HeaterN[ch][4], "KI", "Ki", "%.f", 0., 255., 1., 4.);
+		snprintf(name, sizeof(name), "HEATER%d_SETTINGS", ch + 1);
+		snprintf(label, sizeof(label), "PWM%d loop", ch + 1);
+		IUFillNumberVector(&HeaterNP[ch], HeaterN[ch], 5, getDeviceName(), name, label, HEATER_TAB, IP_RW, 60, IPS_IDLE);
+
+		IUFillNumber(&HeaterStatusN[ch][0], "ERROR", "Error (C)", "%.2f", -64., 64., 0., 0.);
+		IUFillNumber(&HeaterStatusN[ch][1], "INTEGRAL", "Integral (%)", "%.1f", 0., 100., 0., 0.);
+		IUFillNumber(&HeaterStatusN[ch][2], "OUTPUT", "Output (%)", "%.1f", 0., 100., 0., 0.);
+		snprintf(name, sizeof(name), "HEATER%d_STATUS", ch + 1);
+		snprintf(label, sizeof(label), "PWM%d status", ch + 1);
+		IUFillNumberVector(&HeaterStatusNP[ch], HeaterStatusN[ch], 3, getDeviceName(), name, label, HEATER_TAB, IP_RO, 60, IPS_IDLE);
+	}
+
+	IUFillText(&SnoopT[0], "ACTIVE_CCD", "CCD", "");
+	IUFillTextVector(&SnoopTP, SnoopT, 1, getDeviceName(), "ACTIVE_DEVICES", "Snoop devices", OPTIONS_TAB, IP_RW, 60, IPS_IDLE);
 
-	IUFillSwitch(&MoveEWS[0], "MOTION_WEST", "Guide W", ISS_OFF);
-	IUFillSwitch(&MoveEWS[1], "MOTION_EAST", "Guide E", ISS_OFF);
-	IUFillSwitchVector(&MoveEWSP, MoveEWS, 2, getDeviceName(), "TELESCOPE_MOTION_WE", "RA", GUIDE_TAB, IP_RW, ISR_ATMOST1, 0, IPS_IDLE);
+	IUFillText(&MetricsT[0], "ENDPOINT", "Port or socket", getenv("SCOPETEMP_METRICS") ? getenv("SCOPETEMP_METRICS") : "");
+	IUFillTextVector(&MetricsTP, MetricsT, 1, getDeviceName(), "METRICS", "Metrics", OPTIONS_TAB, IP_RW, 60, IPS_IDLE);
 
-	IUFillNumber(&TimedMoveNSN[0], "TIMED_GUIDE_N", "Timed Guide N", "%.1f", -60000., 60000., 0., 0.);
-	IUFillNumber(&TimedMoveNSN[1], "TIMED_GUIDE_S", "Timed Guide S", "%.1f", -60000., 60000., 0., 0.);
-	IUFillNumberVector(&TimedMoveNSNP, TimedMoveNSN, 2, getDeviceName(), "TELESCOPE_TIMED_GUIDE_NS", "Timed DEC Guiding", GUIDE_TAB, IP_RW, 60, IPS_IDLE);
+	if (!_sim && MetricsT[0].text[0]) {
+		if (_metrics.listen(MetricsT[0].text, renderMetrics, this))
+			MetricsTP.s = IPS_OK;
+		else
+			MetricsTP.s = IPS_ALERT;
+	}
 
-	IUFillNumber(&TimedMoveEWN[0], "TIMED_GUIDE_W", "Timed Guide W", "%.1f", -60000., 60000., 0., 0.);
-	IUFillNumber(&TimedMoveEWN[1], "TIMED_GUIDE_E", "Timed Guide E", "%.1f", -60000., 60000., 0., 0.);
-	IUFillNumberVector(&TimedMoveEWNP, TimedMoveEWN, 2, getDeviceName(), "TELESCOPE_TIMED_GUIDE_EW", "Timed RA Guiding", GUIDE_TAB, IP_RW, 60, IPS_IDLE);
+	IUFillText(&TraceT[0], "FILE", "Trace file", "");
+	IUFillTextVector(&TraceTP, TraceT, 1, getDeviceName(), "USB_TRACE", "Record transfers", DIAG_TAB, IP_RW, 60, IPS_IDLE);
+
+	IUFillSwitch(&SpanS[0], "ENABLE", "On", ISS_OFF);
+	IUFillSwitch(&SpanS[1], "DISABLE", "Off", ISS_ON);
+	IUFillSwitchVector(&SpanSP, SpanS, 2, getDeviceName(), "EVENT_TRACE", "Event trace", DIAG_TAB, IP_RW, ISR_1OFMANY, 0, IPS_IDLE);
+
+	IUFillText(&SpanDumpT[0], "FILE", "Dump to", "");
+	IUFillTextVector(&SpanDumpTP, SpanDumpT, 1, getDeviceName(), "EVENT_TRACE_DUMP", "Event trace file", DIAG_TAB, IP_RW, 60, IPS_IDLE);
+
+	IUFillNumber(&GuardN[0], "GUARD", "Guard (ms)", "%.f", 0., 1000., 1., 50.);
+	IUFillNumberVector(&GuardNP, GuardN, 1, getDeviceName(), "GUIDE_GUARD", "Transfer guard", GUIDE_TAB, IP_RW, 60, IPS_IDLE);
+
+	IUFillNumber(&LatencyN[0], "ECHO_RTT", "Echo round trip (ms)", "%.3f", 0., 1000., 0., 0.);
+	IUFillNumber(&LatencyN[1], "ECHO_MAD", "Echo jitter (ms)", "%.3f", 0., 1000., 0., 0.);
+	IUFillNumber(&LatencyN[2], "WRITE_RTT", "Guide write (ms)", "%.3f", 0., 1000., 0., 0.);
+	IUFillNumber(&LatencyN[3], "WRITE_MAD", "Guide write jitter (ms)", "%.3f", 0., 1000., 0., 0.);
+	IUFillNumber(&LatencyN[4], "TIMER_LATE", "Timer lateness (ms)", "%.3f", -1000., 1000., 0., 0.);
+	IUFillNumberVector(&LatencyNP, LatencyN, 5, getDeviceName(), "GUIDE_LATENCY", "Guide latency", GUIDE_TAB, IP_RO, 60, IPS_IDLE);
+
+	IUFillSwitch(&CompS[0], "ENABLE", "On", ISS_ON);
+	IUFillSwitch(&CompS[1], "DISABLE", "Off", ISS_OFF);
+	IUFillSwitchVector(&CompSP, CompS, 2, getDeviceName(), "GUIDE_COMPENSATION", "Latency compensation", GUIDE_TAB, IP_RW, ISR_1OFMANY, 0, IPS_IDLE);
+
+	IUFillNumber(&JitterN[0], "SAMPLES", "Stop edges", "%.f", 0., 1e12, 0., 0.);
+	IUFillNumber(&JitterN[1], "MEAN", "Mean late (ms)", "%.3f", -1000., 1000., 0., 0.);
+	IUFillNumber(&JitterN[2], "P99", "99% late (ms)", "%.3f", -1000., 1000., 0., 0.);
+	IUFillNumber(&JitterN[3], "MAX", "Max late (ms)", "%.3f", -1000., 1000., 0., 0.);
+	IUFillNumberVector(&JitterNP, JitterN, 4, getDeviceName(), "GUIDE_JITTER", "Guide edge jitter", GUIDE_TAB, IP_RO, 60, IPS_IDLE);
+
+	IUFillSwitch(&RtS[0], "ENABLE", "On", ISS_OFF);
+	IUFillSwitch(&RtS[1], "DISABLE", "Off", ISS_ON);
+	IUFillSwitchVector(&RtSP, RtS, 2, getDeviceName(), "REALTIME", "Real-time guiding", OPTIONS_TAB, IP_RW, ISR_1OFMANY, 0, IPS_IDLE);
+
+	IUFillNumber(&RtPrioN[0], "PRIORITY", "SCHED_FIFO priority", "%.f", 1., 99., 1., 50.);
+	IUFillNumberVector(&RtPrioNP, RtPrioN, 1, getDeviceName(), "RT_PRIORITY", "Real-time priority", OPTIONS_TAB, IP_RW, 60, IPS_IDLE);
+
+	IUFillSwitch(&MoveS[GUIDE_AXIS_DEC][0], "MOTION_NORTH", "Guide N", ISS_OFF);
+	IUFillSwitch(&MoveS[GUIDE_AXIS_DEC][1], "MOTION_SOUTH", "Guide S", ISS_OFF);
+	IUFillSwitchVector(&MoveSP[GUIDE_AXIS_DEC], MoveS[GUIDE_AXIS_DEC], 2, getDeviceName(), "TELESCOPE_MOTION_NS", "DEC", GUIDE_TAB, IP_RW, ISR_ATMOST1, 0, IPS_IDLE);
+
+	IUFillSwitch(&MoveS[GUIDE_AXIS_RA][0], "MOTION_WEST", "Guide W", ISS_OFF);
+	IUFillSwitch(&MoveS[GUIDE_AXIS_RA][1], "MOTION_EAST", "Guide E", ISS_OFF);
+	IUFillSwitchVector(&MoveSP[GUIDE_AXIS_RA], MoveS[GUIDE_AXIS_RA], 2, getDeviceName(), "TELESCOPE_MOTION_WE", "RA", GUIDE_TAB, IP_RW, ISR_ATMOST1, 0, IPS_IDLE);
+
+	IUFillNumber(&TimedMoveN[GUIDE_AXIS_DEC][0], "TIMED_GUIDE_N", "Timed Guide N", "%.1f", -60000., 60000., 0., 0.);
+	IUFillNumber(&TimedMoveN[GUIDE_AXIS_DEC][1], "TIMED_GUIDE_S", "Timed Guide S", "%.1f", -60000., 60000., 0., 0.);
+	IUFillNumberVector(&TimedMoveNP[GUIDE_AXIS_DEC], TimedMoveN[GUIDE_AXIS_DEC], 2, getDeviceName(), "TELESCOPE_TIMED_GUIDE_NS", "Timed DEC Guiding", GUIDE_TAB, IP_RW, 60, IPS_IDLE);
+
+	IUFillNumber(&TimedMoveN[GUIDE_AXIS_RA][0], "TIMED_GUIDE_W", "Timed Guide W", "%.1f", -60000., 60000., 0., 0.);
+	IUFillNumber(&TimedMoveN[GUIDE_AXIS_RA][1], "TIMED_GUIDE_E", "Timed Guide E", "%.1f", -60000., 60000., 0., 0.);
+	IUFillNumberVector(&TimedMoveNP[GUIDE_AXIS_RA], TimedMoveN[GUIDE_AXIS_RA], 2, getDeviceName(), "TELESCOPE_TIMED_GUIDE_EW", "Timed RA Guiding", GUIDE_TAB, IP_RW, 60, IPS_IDLE);
+
+	memset(_handlers, 0, sizeof(_handlers));
+	addNumber(&PWMNP, &ScopeTemp::newPWM);
+	addNumber(&RtPrioNP, &ScopeTemp::newRtPriority);
+	addNumber(&PeriodNP, &ScopeTemp::newPeriod);
+	addNumber(&BurstNP, &ScopeTemp::newBurst);
+	addNumber(&StreamNP, &ScopeTemp::newStreamSettings);
+	addNumber(&GuardNP, &ScopeTemp::newGuard);
+	addNumber(&HeaterNP[0], &ScopeTemp::newHeaterSettings, 0);
+	addNumber(&HeaterNP[1], &ScopeTemp::newHeaterSettings, 1);
+	addNumber(&TimedMoveNP[GUIDE_AXIS_DEC], &ScopeTemp::newTimedGuide, GUIDE_AXIS_DEC);
+	addNumber(&TimedMoveNP[GUIDE_AXIS_RA], &ScopeTemp::newTimedGuide, GUIDE_AXIS_RA);
+	addSwitch(&HeaterSP, &ScopeTemp::newHeaterAuto);
+	addSwitch(&RtSP, &ScopeTemp::newRealtime);
+	addSwitch(&StreamSP, &ScopeTemp::newStream);
+	addSwitch(&CompSP, &ScopeTemp::newCompensation);
+	addSwitch(&SpanSP, &ScopeTemp::newEventTrace);
+	addSwitch(&MoveSP[GUIDE_AXIS_DEC], &ScopeTemp::newMotion, GUIDE_AXIS_DEC);
+	addSwitch(&MoveSP[GUIDE_AXIS_RA], &ScopeTemp::newMotion, GUIDE_AXIS_RA);
 
 	return true;
 }
@@ -197,219 +770,1326 @@ bool ScopeTemp::updateProperties()
 
 	if (isConnected()) {
 		defineNumber(&TempNP);
+		defineNumber(&TempTimeNP);
+		defineNumber(&PeriodNP);
+		defineSwitch(&StreamSP);
+		defineNumber(&StreamNP);
+		defineBLOB(&StreamBP);
+		defineNumber(&BurstNP);
+		defineBLOB(&BurstBP);
 		defineNumber(&PWMNP);
-		defineSwitch(&MoveNSSP);
-		defineSwitch(&MoveEWSP);
-		defineNumber(&TimedMoveNSNP);
-		defineNumber(&TimedMoveEWNP);
-
-		if (!_timerTemp)
-			_timerTemp = IEAddTimer(ST_TEMP_POLL_INTERVAL, (void (*)(void *)) pollTemperature, this);
+		if (device.hasCap(THERMAL_CAP_HEATER)) {
+			defineSwitch(&HeaterSP);
+			defineNumber(&HeaterNP[0]);
+			defineNumber(&HeaterStatusNP[0]);
+			defineNumber(&HeaterNP[1]);
+			defineNumber(&HeaterStatusNP[1]);
+		}
+		defineSwitch(&MoveSP[GUIDE_AXIS_DEC]);
+		defineSwitch(&MoveSP[GUIDE_AXIS_RA]);
+		defineNumber(&TimedMoveNP[GUIDE_AXIS_DEC]);
+		defineNumber(&TimedMoveNP[GUIDE_AXIS_RA]);
+		defineNumber(&GuardNP);
+		defineNumber(&LatencyNP);
+		defineSwitch(&CompSP);
+		defineNumber(&JitterNP);
+		defineSwitch(&RtSP);
+		defineNumber(&RtPrioNP);
+		if (device.hasCap(THERMAL_CAP_STATUS))
+			defineNumber(&DiagNP);
+		defineNumber(&StartNP);
+		defineText(&TraceTP);
+		defineSwitch(&SpanSP);
+		defineText(&SpanDumpTP);
+		defineText(&SnoopTP);
+		defineText(&MetricsTP);
+
+		if (SnoopT[0].text && SnoopT[0].text[0])
+			IDSnoopDevice(SnoopT[0].text, "CCD_EXPOSURE");
+
+		if (!_timerTemp) {
+			/* give the first conversions time to finish */
+			for (int i = 0; i < 4; i++)
+				_tempDue[i] = mono() + 1;
+			_heaterDue = mono() + 1;
+			schedulePoll();
+		}
+		if (!_timerStatus && device.hasCap(THERMAL_CAP_STATUS))
+			pollStatus(this);
+		if (!_timerBeat)
+			_timerBeat = addTimer(ST_HEARTBEAT_INTERVAL, heartbeat);
 	} else {
 		deleteProperty(TempNP.name);
+		deleteProperty(TempTimeNP.name);
+		deleteProperty(PeriodNP.name);
+		deleteProperty(StreamSP.name);
+		deleteProperty(StreamNP.name);
+		deleteProperty(StreamBP.name);
+		deleteProperty(BurstNP.name);
+		deleteProperty(BurstBP.name);
 		deleteProperty(PWMNP.name);
-		deleteProperty(MoveNSSP.name);
-		deleteProperty(MoveEWSP.name);
-		deleteProperty(TimedMoveNSNP.name);
-		deleteProperty(TimedMoveEWNP.name);
+		deleteProperty(HeaterSP.name);
+		deleteProperty(HeaterNP[0].name);
+		deleteProperty(HeaterStatusNP[0].name);
+		deleteProperty(HeaterNP[1].name);
+		deleteProperty(HeaterStatusNP[1].name);
+		deleteProperty(MoveSP[GUIDE_AXIS_DEC].name);
+		deleteProperty(MoveSP[GUIDE_AXIS_RA].name);
+		deleteProperty(TimedMoveNP[GUIDE_AXIS_DEC].name);
+		deleteProperty(TimedMoveNP[GUIDE_AXIS_RA].name);
+		deleteProperty(GuardNP.name);
+		deleteProperty(LatencyNP.name);
+		deleteProperty(CompSP.name);
+		deleteProperty(JitterNP.name);
+		deleteProperty(RtSP.name);
+		deleteProperty(RtPrioNP.name);
+		deleteProperty(DiagNP.name);
+		deleteProperty(StartNP.name);
+		deleteProperty(TraceTP.name);
+		deleteProperty(SpanSP.name);
+		deleteProperty(SpanDumpTP.name);
+		deleteProperty(SnoopTP.name);
+		deleteProperty(MetricsTP.name);
 
 		if (_timerTemp) {
-			IERmTimer(_timerTemp);
+			rmTimer(_timerTemp);
 			_timerTemp = 0;
 		}
+		if (_timerStatus) {
+			rmTimer(_timerStatus);
+			_timerStatus = 0;
+		}
+		if (_timerBeat) {
+			rmTimer(_timerBeat);
+			_timerBeat = 0;
+		}
+		if (_timerOutputs) {
+			rmTimer(_timerOutputs);
+			_timerOutputs = 0;
+		}
+		_pending = 0;
+		if (_timerStream) {
+			rmTimer(_timerStream);
+			_timerStream = 0;
+		}
+		if (_timerBurst) {
+			rmTimer(_timerBurst);
+			_timerBurst = 0;
+		}
+		_stream.header.count = 0;
+		_burst.header.count = 0;
+		_pollNext = _pollFresh = 0;
 	}
 
 	return true;
 }
 
-bool ScopeTemp::ISNewNumber(const char *dev, const char *name, double values[], char *names[], int n)
+/* Property names hash into an open addressed table, filled once by
+   initProperties(), so a client command costs a hash and one strcmp
+   however many properties we grow. */
+static unsigned int prop_hash(const char *name)
 {
-	int pwm1, pwm2;
-	double duration;
-	int dir;
-
-	if (!strcmp(dev, getDeviceName())) {
-		if (!strcmp(name, PWMNP.name)) {
-			IUUpdateNumber(&PWMNP, values, names, n);
+	unsigned int h = 2166136261u;
 
-			pwm1 = (PWMN[0].value / 100.0) * 65535;
-			pwm2 = (PWMN[1].value / 100.0) * 65535;
-			setPWM(pwm1, pwm2);
+	while (*name)
+		h = (h ^ (unsigned char) *name++) * 16777619u;
 
-			PWMNP.s = IPS_OK;
-			IDSetNumber(&PWMNP, NULL);
+	return h;
+}
 
-			return true;
-		}
+void ScopeTemp::addHandler(const char *name, NumberHandler number, SwitchHandler sw, int arg)
+{
+	unsigned int i = prop_hash(name);
 
-		if (!strcmp(name, TimedMoveNSNP.name)) {
-			TimedMoveNSN[0].value = 0.0;
-			TimedMoveNSN[1].value = 0.0;
+	while (_handlers[i & (ST_HANDLERS - 1)].name)
+		i++;
 
-			IUUpdateNumber(&TimedMoveNSNP, values, names, n);
+	_handlers[i & (ST_HANDLERS - 1)].name = name;
+	_handlers[i & (ST_HANDLERS - 1)].number = number;
+	_handlers[i & (ST_HANDLERS - 1)].sw = sw;
+	_handlers[i & (ST_HANDLERS - 1)].arg = arg;
+}
 
-			if (TimedMoveNSN[0].value != 0.0) {
-				duration = TimedMoveNSN[0].value;
-				dir = 0;
-			} else {
-				duration = TimedMoveNSN[1].value;
-				dir = 1;
-			}
+const ScopeTemp::handler *ScopeTemp::findHandler(const char *dev, const char *name)
+{
+	unsigned int i;
 
-			guide_NS(duration, dir);
+	if (strcmp(dev, getDeviceName()))
+		return NULL;
 
-			TimedMoveNSN[0].value = 0.0;
-			TimedMoveNSN[1].value = 0.0;
-			TimedMoveNSNP.s = IPS_OK;
-			IDSetNumber(&TimedMoveNSNP, NULL);
+	for (i = prop_hash(name); _handlers[i & (ST_HANDLERS - 1)].name; i++)
+		if (!strcmp(_handlers[i & (ST_HANDLERS - 1)].name, name))
+			return &_handlers[i & (ST_HANDLERS - 1)];
 
-			return true;
-		}
+	return NULL;
+}
 
-		if (!strcmp(name, TimedMoveEWNP.name)) {
-			TimedMoveEWN[0].value = 0.0;
-			TimedMoveEWN[1].value = 0.0;
+void ScopeTemp::addNumber(INumberVectorProperty *nvp, NumberHandler h, int arg)
+{
+	addHandler(nvp->name, h, NULL, arg);
+}
 
-			IUUpdateNumber(&TimedMoveEWNP, values, names, n);
+void ScopeTemp::addSwitch(ISwitchVectorProperty *svp, SwitchHandler h, int arg)
+{
+	addHandler(svp->name, NULL, h, arg);
+}
 
-			if (TimedMoveEWN[0].value != 0.0) {
-				duration = TimedMoveEWN[0].value;
-				dir = 0;
-			} else {
-				duration = TimedMoveEWN[1].value;
-				dir = 1;
-			}
+bool ScopeTemp::ISNewNumber(const char *dev, const char *name, double values[], char *names[], int n)
+{
+	const handler *h = findHandler(dev, name);
 
-			guide_EW(duration, dir);
+	if (h && h->number) {
+		ScopeTempSpan span(h->name, "ISNew");
+		return (this->*h->number)(h->arg, values, names, n);
+	}
 
-			TimedMoveEWN[0].value = 0.0;
-			TimedMoveEWN[1].value = 0.0;
-			TimedMoveEWNP.s = IPS_OK;
-			IDSetNumber(&TimedMoveEWNP, NULL);
+	return INDI::DefaultDevice::ISNewNumber(dev, name, values, names, n);
+}
 
-			return true;
-		}
+bool ScopeTemp::ISNewSwitch(const char *dev, const char *name, ISState *states, char *names[], int n)
+{
+	const handler *h = findHandler(dev, name);
 
+	if (h && h->sw) {
+		ScopeTempSpan span(h->name, "ISNew");
+		return (this->*h->sw)(h->arg, states, names, n);
 	}
-	return INDI::DefaultDevice::ISNewNumber(dev, name, values, names, n);
+
+	return INDI::DefaultDevice::ISNewSwitch(dev, name, states, names, n);
 }
 
-bool ScopeTemp::ISNewSwitch(const char *dev, const char *name, ISState *states, char *names[], int n)
+bool ScopeTemp::newPWM(int, double values[], char *names[], int n)
 {
-	if (!strcmp(dev, getDeviceName())) {
-		if (!strcmp(name, MoveNSSP.name)) {
-			MoveNSS[0].s = MoveNSS[1].s = ISS_OFF;
+	IUUpdateNumber(&PWMNP, values, names, n);
 
-			/* no contradictory moves */
-			if ((n > 1) && (states[0] == ISS_ON) && (states[1] == ISS_ON)) {
-				states[0] = states[1] = ISS_OFF;
-			}
+	/* held back until after a guide edge */
+	if (queueOutputs(ST_PENDING_PWM)) {
+		PWMNP.s = IPS_BUSY;
+		setNumber(&PWMNP);
+	}
 
-			IUUpdateSwitch(&MoveNSSP, states, names, n);
+	return true;
+}
 
-			/* stop timers on manual moves */
-			guide_NS(0, 0);
-			guide_EW(0, 0);
+bool ScopeTemp::newRtPriority(int, double values[], char *names[], int n)
+{
+	IUUpdateNumber(&RtPrioNP, values, names, n);
+	RtPrioNP.s = (RtS[0].s != ISS_ON || setRealtime(true)) ? IPS_OK : IPS_ALERT;
+	setNumber(&RtPrioNP);
 
-			setGuiding((MoveNSS[0].s == ISS_ON), (MoveNSS[1].s == ISS_ON),
-				   (MoveEWS[0].s == ISS_ON), (MoveEWS[1].s == ISS_ON));
+	return true;
+}
 
-			MoveNSSP.s = IPS_OK;
-			IDSetSwitch(&MoveNSSP, NULL);
+bool ScopeTemp::newPeriod(int, double values[], char *names[], int n)
+{
+	double t = mono();
 
-			return true;
-		}
-		if (!strcmp(name, MoveEWSP.name)) {
-			MoveEWS[0].s = MoveEWS[1].s = ISS_OFF;
+	IUUpdateNumber(&PeriodNP, values, names, n);
 
-			/* no contradictory moves */
-			if ((n > 1) && (states[0] == ISS_ON) && (states[1] == ISS_ON)) {
-				states[0] = states[1] = ISS_OFF;
-			}
+	/* shorter periods take effect right away */
+	for (int i = 0; i < 4; i++)
+		_tempDue[i] = std::min(_tempDue[i], t + PeriodN[i].value);
+	if (_timerTemp && !_pollNext) {
+		rmTimer(_timerTemp);
+		schedulePoll();
+	}
 
-			IUUpdateSwitch(&MoveEWSP, states, names, n);
+	PeriodNP.s = IPS_OK;
+	setNumber(&PeriodNP);
 
-			/* stop timers on manual moves */
-			guide_NS(0, 0);
-			guide_EW(0, 0);
+	return true;
+}
 
-			setGuiding((MoveNSS[0].s == ISS_ON), (MoveNSS[1].s == ISS_ON),
-				   (MoveEWS[0].s == ISS_ON), (MoveEWS[1].s == ISS_ON));
+bool ScopeTemp::newBurst(int, double values[], char *names[], int n)
+{
+	if (_timerBurst) {
+		setNumber(&BurstNP, "A burst is already running");
+		return true;
+	}
 
-			MoveEWSP.s = IPS_OK;
-			IDSetSwitch(&MoveEWSP, NULL);
+	IUUpdateNumber(&BurstNP, values, names, n);
 
-			return true;
-		}
+	/* normal polling resumes from scratch when we're done */
+	if (_timerTemp) {
+		rmTimer(_timerTemp);
+		_timerTemp = 0;
+	}
+	_pollNext = 0;
 
+	_burst.header.count = 0;
+	_burstEnd = mono() + BurstN[0].value;
+	pollBurst(this);
+
+	if (_timerBurst) {
+		BurstNP.s = IPS_BUSY;
+		setNumber(&BurstNP);
 	}
-	return INDI::DefaultDevice::ISNewSwitch(dev, name, states, names, n);
+
+	return true;
 }
 
-void ScopeTemp::stop_NS(ScopeTemp *dev)
+bool ScopeTemp::newStreamSettings(int, double values[], char *names[], int n)
 {
-	dev->_guideN = dev->_guideS = 0;
-	dev->setGuiding(dev->_guideN, dev->_guideS, dev->_guideE, dev->_guideW);
+	IUUpdateNumber(&StreamNP, values, names, n);
+	StreamNP.s = IPS_OK;
+	setNumber(&StreamNP);
+
+	return true;
 }
 
-bool ScopeTemp::guide_NS(double duration, int dir)
+bool ScopeTemp::newGuard(int, double values[], char *names[], int n)
 {
-	if (_timerNS) {
-		IERmTimer(_timerNS);
-		_timerNS = 0;
-	}
+	IUUpdateNumber(&GuardNP, values, names, n);
+	GuardNP.s = IPS_OK;
+	setNumber(&GuardNP);
 
-	_guideN = _guideS = 0;
-	if (duration <= 0.0) {
-		setGuiding(_guideN, _guideS, _guideE, _guideW);
-		return true;
-	}
+	return true;
+}
 
-	_guideN = !dir;
-	_guideS = dir;
+bool ScopeTemp::newHeaterSettings(int ch, double values[], char *names[], int n)
+{
+	IUUpdateNumber(&HeaterNP[ch], values, names, n);
 
-	setGuiding(_guideN, _guideS, _guideE, _guideW);
-	_timerNS = IEAddTimer(floor(duration), (void (*)(void *)) stop_NS, this);
+	if (queueOutputs(ST_PENDING_HEATER << ch)) {
+		HeaterNP[ch].s = IPS_BUSY;
+		setNumber(&HeaterNP[ch]);
+	}
 
 	return true;
 }
 
-void ScopeTemp::stop_EW(ScopeTemp *dev)
+bool ScopeTemp::newTimedGuide(int axis, double values[], char *names[], int n)
 {
-	dev->_guideE = dev->_guideW = 0;
-	dev->setGuiding(dev->_guideN, dev->_guideS, dev->_guideE, dev->_guideW);
+	INumber *np = TimedMoveN[axis];
+	double duration;
+	int dir;
+
+	np[0].value = 0.0;
+	np[1].value = 0.0;
+
+	IUUpdateNumber(&TimedMoveNP[axis], values, names, n);
+
+	if (np[0].value != 0.0) {
+		duration = np[0].value;
+		dir = 0;
+	} else {
+		duration = np[1].value;
+		dir = 1;
+	}
+
+	np[0].value = 0.0;
+	np[1].value = 0.0;
+	TimedMoveNP[axis].s = guide(axis, duration, dir) ? IPS_OK : IPS_ALERT;
+	setNumber(&TimedMoveNP[axis]);
+
+	return true;
 }
 
-bool ScopeTemp::guide_EW(double duration, int dir)
+bool ScopeTemp::newHeaterAuto(int, ISState *states, char *names[], int n)
 {
-	if (_timerEW) {
-		IERmTimer(_timerEW);
-		_timerEW = 0;
-	}
+	IUUpdateSwitch(&HeaterSP, states, names, n);
 
-	_guideW = _guideE = 0;
-	if (duration <= 0.0) {
-		setGuiding(_guideN, _guideS, _guideE, _guideW);
-		return true;
+	/* manual control picks up where the loop left off */
+	if (queueOutputs(ST_PENDING_AUTO | ST_PENDING_HEATER | (ST_PENDING_HEATER << 1) | ST_PENDING_PWM)) {
+		HeaterSP.s = IPS_BUSY;
+		setSwitch(&HeaterSP);
 	}
 
-	_guideW = !dir;
-	_guideE = dir;
+	return true;
+}
+
+bool ScopeTemp::newRealtime(int, ISState *states, char *names[], int n)
+{
+	bool on;
+
+	IUUpdateSwitch(&RtSP, states, names, n);
+	on = RtS[0].s == ISS_ON;
 
-	setGuiding(_guideN, _guideS, _guideE, _guideW);
-	_timerEW = IEAddTimer(floor(duration), (void (*)(void *)) stop_EW, this);
+	/* report the jitter so far, then start afresh for the new mode */
+	updateJitter();
+	IDMessage(getDeviceName(), "Guide edges %s real-time mode: %.f edges, mean %.3f ms, p99 %.3f ms, max %.3f ms late",
+		  on ? "before" : "in", JitterN[0].value, JitterN[1].value, JitterN[2].value, JitterN[3].value);
+	_jitterCount = 0;
+
+	if (setRealtime(on)) {
+		RtSP.s = on ? IPS_OK : IPS_IDLE;
+		setSwitch(&RtSP);
+	} else {
+		RtS[0].s = ISS_OFF;
+		RtS[1].s = ISS_ON;
+		RtSP.s = IPS_ALERT;
+		setSwitch(&RtSP, "Cannot switch to SCHED_FIFO or lock memory: %s", strerror(errno));
+	}
+	updateJitter();
 
 	return true;
 }
 
-void ScopeTemp::pollTemperature(ScopeTemp *dev)
+bool ScopeTemp::newStream(int, ISState *states, char *names[], int n)
 {
-	int i;
+	IUUpdateSwitch(&StreamSP, states, names, n);
 
-	for (i = 0; i < 4; i++) {
-		dev->getTemperature(i, &dev->TempN[i].value);
+	if (StreamS[0].s == ISS_ON) {
+		_stream.header.count = 0;
+		if (!_timerStream)
+			_timerStream = addTimer(StreamN[0].value * 1000, flushStream);
+		StreamSP.s = IPS_BUSY;
+	} else {
+		if (_timerStream) {
+			rmTimer(_timerStream);
+			flushStream(this);
+		}
+		StreamSP.s = IPS_IDLE;
 	}
-	IDSetNumber(&dev->TempNP, NULL);
+	setSwitch(&StreamSP);
+
+	return true;
+}
+
+bool ScopeTemp::newCompensation(int, ISState *states, char *names[], int n)
+{
+	IUUpdateSwitch(&CompSP, states, names, n);
+	CompSP.s = IPS_OK;
+	setSwitch(&CompSP);
 
-	dev->_timerTemp = IEAddTimer(ST_TEMP_POLL_INTERVAL, (void (*)(void *)) pollTemperature, dev);
+	return true;
+}
+
+/* turning it on starts a fresh ring */
+bool ScopeTemp::newEventTrace(int, ISState *states, char *names[], int n)
+{
+	IUUpdateSwitch(&SpanSP, states, names, n);
+
+	st_spans.enable(SpanS[0].s == ISS_ON);
+	SpanSP.s = st_spans.enabled() ? IPS_BUSY : IPS_IDLE;
+	setSwitch(&SpanSP);
+
+	return true;
+}
+
+bool ScopeTemp::newMotion(int axis, ISState *states, char *names[], int n)
+{
+	MoveS[axis][0].s = MoveS[axis][1].s = ISS_OFF;
+
+	/* no contradictory moves */
+	if ((n > 1) && (states[0] == ISS_ON) && (states[1] == ISS_ON)) {
+		states[0] = states[1] = ISS_OFF;
+	}
+
+	IUUpdateSwitch(&MoveSP[axis], states, names, n);
+
+	/* stop timers on manual moves */
+	guide(GUIDE_AXIS_DEC, 0, 0);
+	guide(GUIDE_AXIS_RA, 0, 0);
+
+	setGuiding((MoveS[GUIDE_AXIS_DEC][0].s == ISS_ON), (MoveS[GUIDE_AXIS_DEC][1].s == ISS_ON),
+		   (MoveS[GUIDE_AXIS_RA][0].s == ISS_ON), (MoveS[GUIDE_AXIS_RA][1].s == ISS_ON));
+
+	MoveSP[axis].s = IPS_OK;
+	setSwitch(&MoveSP[axis]);
+
+	return true;
+}
+
+bool ScopeTemp::ISNewText(const char *dev, const char *name, char *texts[], char *names[], int n)
+{
+	if (!strcmp(dev, getDeviceName())) {
+		if (!strcmp(name, SnoopTP.name)) {
+			ScopeTempSpan span(SnoopTP.name, "ISNew");
+
+			IUUpdateText(&SnoopTP, texts, names, n);
+
+			_ccdReadout = false;
+			if (SnoopT[0].text[0])
+				IDSnoopDevice(SnoopT[0].text, "CCD_EXPOSURE");
+
+			SnoopTP.s = IPS_OK;
+			setText(&SnoopTP);
+
+			return true;
+		}
+
+		if (!strcmp(name, TraceTP.name)) {
+			ScopeTempSpan span(TraceTP.name, "ISNew");
+
+			IUUpdateText(&TraceTP, texts, names, n);
+
+			if (!setTrace(TraceT[0].text)) {
+				TraceTP.s = IPS_ALERT;
+				setText(&TraceTP, "Cannot write %s: %s", TraceT[0].text, strerror(errno));
+				IUSaveText(&TraceT[0], "");
+			} else if (_record.recording()) {
+				TraceTP.s = IPS_BUSY;
+				setText(&TraceTP, "Recording transfers to %s", TraceT[0].text);
+			} else {
+				TraceTP.s = IPS_IDLE;
+				setText(&TraceTP, "Trace closed, %lu records", _record.records());
+			}
+
+			return true;
+		}
+
+		if (!strcmp(name, MetricsTP.name)) {
+			ScopeTempSpan span(MetricsTP.name, "ISNew");
+
+			IUUpdateText(&MetricsTP, texts, names, n);
+
+			if (!_metrics.listen(MetricsT[0].text, renderMetrics, this)) {
+				MetricsTP.s = IPS_ALERT;
+				setText(&MetricsTP, "Cannot listen on %s: %s", MetricsT[0].text, strerror(errno));
+			} else if (_metrics.listening()) {
+				MetricsTP.s = IPS_OK;
+				setText(&MetricsTP, "Metrics on %s", MetricsT[0].text);
+			} else {
+				MetricsTP.s = IPS_IDLE;
+				setText(&MetricsTP, "Metrics off");
+			}
+
+			return true;
+		}
+
+		if (!strcmp(name, SpanDumpTP.name)) {
+			IUUpdateText(&SpanDumpTP, texts, names, n);
+
+			if (st_spans.dump(SpanDumpT[0].text)) {
+				SpanDumpTP.s = IPS_OK;
+				setText(&SpanDumpTP, "%lu spans so far, the last %lu in %s", st_spans.count(),
+					  st_spans.kept(), SpanDumpT[0].text);
+			} else {
+				SpanDumpTP.s = IPS_ALERT;
+				setText(&SpanDumpTP, "Cannot write %s: %s", SpanDumpT[0].text, strerror(errno));
+			}
+
+			return true;
+		}
+	}
+	return INDI::DefaultDevice::ISNewText(dev, name, texts, names, n);
+}
+
+/* The CCD driver counts CCD_EXPOSURE down while busy and only goes idle or
+   ok once the frame is downloaded. Treat the tail of the exposure and
+   everything after it as readout. */
+bool ScopeTemp::ISSnoopDevice(XMLEle *root)
+{
+	const char *dev = findXMLAttValu(root, "device");
+	const char *name = findXMLAttValu(root, "name");
+	XMLEle *ep;
+	IPState state;
+	double left = 0;
+	bool readout;
+
+	if (!SnoopT[0].text || strcmp(dev, SnoopT[0].text) || strcmp(name, "CCD_EXPOSURE"))
+		return INDI::DefaultDevice::ISSnoopDevice(root);
+
+	if (crackIPState(findXMLAttValu(root, "state"), &state) < 0)
+		return false;
+
+	for (ep = nextXMLEle(root, 1); ep; ep = nextXMLEle(root, 0)) {
+		if (!strcmp(findXMLAttValu(ep, "name"), "CCD_EXPOSURE_VALUE"))
+			left = atof(pcdataXMLEle(ep));
+	}
+
+	readout = (state == IPS_BUSY) && (left <= ST_QUIET_LEAD);
+	if (readout && !_ccdReadout)
+		_ccdReadoutSince = mono();
+	_ccdReadout = readout;
+
+	return true;
+}
+
+/* No bulk transfers while the CCD downloads. Guiding is never held off,
+   and the device keeps averaging so no samples are lost. */
+bool ScopeTemp::quiet()
+{
+	return _ccdReadout && mono() - _ccdReadoutSince < ST_QUIET_MAX;
+}
+
+bool ScopeTemp::setGuiding(int n, int s, int w, int e)
+{
+	bool ok = device.setGuiding(n, s, w, e);
+
+	if (ok)
+		shm.publishGuide(n, s, w, e);
+
+	return ok;
+}
+
+bool ScopeTemp::pushHeater(int ch)
+{
+	return device.setHeaterGains(ch, HeaterN[ch][3].value, HeaterN[ch][4].value) &&
+		device.setHeater(ch, HeaterS[ch].s == ISS_ON, HeaterN[ch][0].value - 1, HeaterN[ch][1].value - 1, HeaterN[ch][2].value);
+}
+
+/* USB requests are serialized, so a stop edge sent while a temperature
+   read is in flight waits for it. Returns the milisec to hold non-urgent
+   transfers for, 0 if there's no guide edge within the guard window. */
+int ScopeTemp::edgeWait()
+{
+	double edge, t = mono();
+
+	edge = _edge[GUIDE_AXIS_DEC];
+	if (_edge[GUIDE_AXIS_RA] && (!edge || _edge[GUIDE_AXIS_RA] < edge))
+		edge = _edge[GUIDE_AXIS_RA];
+
+	if (!edge || edge - t > GuardN[0].value / 1000.0)
+		return 0;
+
+	return std::max(0., (edge - t) * 1000) + ST_GUARD_SLACK;
+}
+
+/* true if cb had to be rescheduled for after the next guide edge */
+bool ScopeTemp::guardEdge(void (*cb)(ScopeTemp *), int *timer)
+{
+	int wait = edgeWait();
+
+	if (!wait)
+		return false;
+
+	*timer = addTimer(wait, cb);
+
+	return true;
+}
+
+/* true if some of what still waits for a guide edge */
+bool ScopeTemp::queueOutputs(int what)
+{
+	_pending |= what;
+	if (!_timerOutputs)
+		flushOutputs(this);
+
+	return (_pending & what) != 0;
+}
+
+void ScopeTemp::flushOutputs(ScopeTemp *dev)
+{
+	ScopeTempSpan span("flushOutputs", "timer");
+	bool ok = true;
+	int ch, what;
+
+	dev->_timerOutputs = 0;
+
+	if (!dev->_pending || dev->guardEdge(flushOutputs, &dev->_timerOutputs))
+		return;
+
+	what = dev->_pending;
+	dev->_pending = 0;
+
+	/* the loops first, PWM takes over a channel they let go of */
+	for (ch = 0; ch < 2; ch++) {
+		if (!(what & (ST_PENDING_HEATER << ch)))
+			continue;
+		dev->HeaterNP[ch].s = dev->pushHeater(ch) ? IPS_OK : IPS_ALERT;
+		ok &= dev->HeaterNP[ch].s == IPS_OK;
+		setNumber(&dev->HeaterNP[ch]);
+	}
+
+	if (what & ST_PENDING_PWM) {
+		dev->PWMNP.s = dev->device.setPWM((dev->PWMN[0].value / 100.0) * 65535, (dev->PWMN[1].value / 100.0) * 65535) ? IPS_OK : IPS_ALERT;
+		ok &= dev->PWMNP.s == IPS_OK;
+		setNumber(&dev->PWMNP);
+	}
+
+	if (what & ST_PENDING_AUTO) {
+		dev->HeaterSP.s = ok ? IPS_OK : IPS_ALERT;
+		setSwitch(&dev->HeaterSP);
+	}
+
+	dev->saveState();
+}
+
+/* the loops run on the device, we only show what they're doing */
+void ScopeTemp::pollHeaters()
+{
+	ScopeTempDevice::heater h;
+	int ch, pwm = 0;
+
+	for (ch = 0; ch < 2; ch++) {
+		if (HeaterS[ch].s != ISS_ON)
+			continue;
+
+		/* display only, catch up next poll */
+		if (edgeWait())
+			break;
+
+		if (!device.getHeater(ch, &h)) {
+			HeaterStatusNP[ch].s = IPS_ALERT;
+			setNumber(&HeaterStatusNP[ch]);
+			continue;
+		}
+
+		HeaterStatusN[ch][0].value = h.error;
+		HeaterStatusN[ch][1].value = h.integ;
+		HeaterStatusN[ch][2].value = h.out;
+		if (h.lost && HeaterStatusNP[ch].s != IPS_ALERT) {
+			HeaterStatusNP[ch].s = IPS_ALERT;
+			setNumber(&HeaterStatusNP[ch], "Heater %d: T%d or T%d is gone, output off until they're back",
+				    ch + 1, h.sensor + 1, h.ref + 1);
+		} else {
+			HeaterStatusNP[ch].s = h.lost ? IPS_ALERT : IPS_OK;
+			setNumber(&HeaterStatusNP[ch]);
+		}
+
+		PWMN[ch].value = h.out;
+		pwm++;
+	}
+
+	if (pwm)
+		setNumber(&PWMNP);
+}
+
+/* the outputs as _guide has them */
+bool ScopeTemp::pushGuide()
+{
+	return setGuiding(_guide[GUIDE_AXIS_DEC][0], _guide[GUIDE_AXIS_DEC][1],
+			  _guide[GUIDE_AXIS_RA][0], _guide[GUIDE_AXIS_RA][1]);
+}
+
+void ScopeTemp::stop_NS(ScopeTemp *dev)
+{
+	ScopeTempSpan span("stop_NS", "timer");
+
+	dev->stopGuide(GUIDE_AXIS_DEC);
+}
+
+void ScopeTemp::stop_EW(ScopeTemp *dev)
+{
+	ScopeTempSpan span("stop_EW", "timer");
+
+	dev->stopGuide(GUIDE_AXIS_RA);
+}
+
+/* With device timed pulses there's no edge to send, the board has
+   already switched the axis off, we just catch up. */
+void ScopeTemp::stopGuide(int axis)
+{
+	_timerGuide[axis] = 0;
+	_guide[axis][0] = _guide[axis][1] = 0;
+
+	if (device.hasCap(THERMAL_CAP_PULSE)) {
+		shm.publishGuide(_guide[GUIDE_AXIS_DEC][0], _guide[GUIDE_AXIS_DEC][1],
+				 _guide[GUIDE_AXIS_RA][0], _guide[GUIDE_AXIS_RA][1]);
+		return;
+	}
+
+	timerLate(mono() - _edge[axis]);
+	_edge[axis] = 0;
+
+	/* a lost stop leaves the output on until the next write */
+	if (!pushGuide() && device.lastError() != LIBUSB_ERROR_NO_DEVICE)
+		pushGuide();
+}
+
+/* dir 0 is N or W, 1 is S or E */
+bool ScopeTemp::guide(int axis, double duration, int dir)
+{
+	void (*stop)(ScopeTemp *) = axis == GUIDE_AXIS_DEC ? stop_NS : stop_EW;
+
+	if (_timerGuide[axis]) {
+		rmTimer(_timerGuide[axis]);
+		_timerGuide[axis] = 0;
+	}
+	_edge[axis] = 0;
+
+	_guide[axis][0] = _guide[axis][1] = 0;
+
+	if (device.hasCap(THERMAL_CAP_PULSE)) {
+		if (duration > 0.0) {
+			_guide[axis][0] = !dir;
+			_guide[axis][1] = dir;
+		}
+		if (!device.pulse(axis, _guide[axis][0], _guide[axis][1], lround(duration))) {
+			_guide[axis][0] = _guide[axis][1] = 0;
+			return false;
+		}
+		if (duration > 0.0) {
+			_pulses[axis][dir]++;
+			_pulseTime[axis][dir] += lround(duration) / 1000.0;
+		}
+		shm.publishGuide(_guide[GUIDE_AXIS_DEC][0], _guide[GUIDE_AXIS_DEC][1],
+				 _guide[GUIDE_AXIS_RA][0], _guide[GUIDE_AXIS_RA][1]);
+		if (duration > 0.0)
+			_timerGuide[axis] = addTimer(lround(duration), stop);
+		return true;
+	}
+
+	if (duration <= 0.0)
+		return pushGuide();
+
+	_guide[axis][0] = !dir;
+	_guide[axis][1] = dir;
+
+	/* not left set for the next write to start late */
+	if (!pushGuide()) {
+		_guide[axis][0] = _guide[axis][1] = 0;
+		return false;
+	}
+	_pulses[axis][dir]++;
+	_pulseTime[axis][dir] += lround(duration) / 1000.0;
+	duration = guideDelay(duration);
+	_timerGuide[axis] = addTimer(lround(duration), stop);
+	_edge[axis] = mono() + lround(duration) / 1000.0;
+
+	return true;
+}
+
+/* true once the block is full */
+bool ScopeTemp::blockAdd(struct block *b, int id, const ScopeTempDevice::sample &sample)
+{
+	struct st_block_record *r;
+
+	if (b->header.count == 0)
+		b->header.t0 = sample.when;
+
+	r = &b->record[b->header.count++];
+	r->dt = lround((sample.when - b->header.t0) * 1000);
+	r->sensor = id;
+	r->count = sample.count;
+	r->temp = sample.temp;
+
+	return b->header.count == ST_BLOCK_RECORDS;
+}
+
+void ScopeTemp::blockSend(struct block *b, IBLOB *blob, IBLOBVectorProperty *bvp)
+{
+	b->header.magic = ST_BLOCK_MAGIC;
+	b->header.version = ST_BLOCK_VERSION;
+
+	blob->blob = b;
+	blob->bloblen = blob->size = sizeof(b->header) + b->header.count * sizeof(b->record[0]);
+	bvp->s = IPS_OK;
+	setBLOB(bvp);
+
+	b->header.count = 0;
+}
+
+void ScopeTemp::flushStream(ScopeTemp *dev)
+{
+	ScopeTempSpan span("flushStream", "timer");
+
+	dev->_timerStream = 0;
+
+	if (dev->_stream.header.count)
+		dev->blockSend(&dev->_stream, &dev->StreamB[0], &dev->StreamBP);
+
+	if (dev->StreamS[0].s == ISS_ON)
+		dev->_timerStream = dev->addTimer(dev->StreamN[0].value * 1000, flushStream);
+}
+
+void ScopeTemp::pollBurst(ScopeTemp *dev)
+{
+	ScopeTempDevice::sample sample;
+	int i;
+	ScopeTempSpan span("pollBurst", "timer");
+
+	dev->_timerBurst = 0;
+
+	if (dev->quiet()) {
+		dev->_timerBurst = dev->addTimer(ST_QUIET_RETRY, pollBurst);
+		return;
+	}
+
+	if (dev->guardEdge(pollBurst, &dev->_timerBurst))
+		return;
+
+	for (i = 0; i < 4; i++) {
+		if (dev->_tempMember[i] < 0 || !dev->device.getTemperature(i, &sample))
+			continue;
+
+		if (sample.seq == 0 || sample.count == 0 || sample.seq == dev->_tempSeq[i])
+			continue;
+
+		dev->_tempSeq[i] = sample.seq;
+		if (blockAdd(&dev->_burst, i, sample)) {
+			dev->endBurst();
+			return;
+		}
+	}
+
+	if (dev->mono() >= dev->_burstEnd) {
+		dev->endBurst();
+		return;
+	}
+
+	dev->_timerBurst = dev->addTimer(ST_BURST_INTERVAL, pollBurst);
+}
+
+/* send what we have and go back to normal polling */
+void ScopeTemp::endBurst()
+{
+	if (_timerBurst) {
+		rmTimer(_timerBurst);
+		_timerBurst = 0;
+	}
+
+	blockSend(&_burst, &BurstB[0], &BurstBP);
+
+	BurstNP.s = IPS_OK;
+	setNumber(&BurstNP, "Burst done");
+
+	if (!_timerTemp)
+		schedulePoll();
+}
+
+void ScopeTemp::setPresent(uint8_t present)
+{
+	double when[4];
+	int i, n = 0;
+	char name[8], label[16];
+
+	if (present == _present)
+		return;
+
+	for (i = 0; i < 4; i++)
+		when[i] = _tempMember[i] < 0 ? 0 : TempTimeN[_tempMember[i]].value;
+
+	for (i = 0; i < 4; i++) {
+		if (!(present & (1 << i))) {
+			_tempMember[i] = -1;
+			_tempSeq[i] = 0;
+			_temp[i] = 0;
+			if (_present & (1 << i))
+				IDMessage(getDeviceName(), "T%d is gone", i + 1);
+			continue;
+		}
+
+		snprintf(name, sizeof(name), "T%d", i + 1);
+		snprintf(label, sizeof(label), "T%d (C)", i + 1);
+		IUFillNumber(&TempN[n], name, label, "%5.2f", -55., 125., 0., st_celsius(_temp[i]));
+		snprintf(label, sizeof(label), "T%d (s)", i + 1);
+		IUFillNumber(&TempTimeN[n], name, label, "%.3f", 0., 1e10, 0., when[i]);
+		_tempMember[i] = n++;
+	}
+	_present = present;
+
+	TempNP.nnp = n;
+	TempTimeNP.nnp = n;
+
+	/* Connect() sets it before there's anything defined */
+	if (isConnected()) {
+		deleteProperty(TempNP.name);
+		deleteProperty(TempTimeNP.name);
+		defineNumber(&TempNP);
+		defineNumber(&TempTimeNP);
+		saveState();
+	}
+}
+
+/* one timer for all sensors, due when the first of them is */
+void ScopeTemp::schedulePoll()
+{
+	double next = _heaterDue;
+	int i;
+
+	for (i = 0; i < 4; i++)
+		if (_tempMember[i] >= 0)
+			next = std::min(next, _tempDue[i]);
+
+	/* rounded up, an early timer would only find nothing due and spin */
+	_timerTemp = addTimer(std::max(0., ceil((next - mono()) * 1000)), pollTemperature);
+}
+
+void ScopeTemp::pollTemperature(ScopeTemp *dev)
+{
+	ScopeTempDevice::sample sample;
+	double t = dev->mono();
+	int i;
+	ScopeTempSpan span("pollTemperature", "timer");
+
+	if (dev->quiet()) {
+		dev->_timerTemp = dev->addTimer(ST_QUIET_RETRY, pollTemperature);
+		return;
+	}
+
+	/* only the sensors that are due, one per transfer, and pick up where
+	   a guide edge stopped us */
+	for (i = dev->_pollNext; i < 4; i++) {
+		if (dev->_tempMember[i] < 0 || dev->_tempDue[i] > t)
+			continue;
+
+		if (dev->guardEdge(pollTemperature, &dev->_timerTemp)) {
+			dev->_pollNext = i;
+			return;
+		}
+
+		dev->_tempDue[i] += dev->PeriodN[i].value;
+		if (dev->_tempDue[i] < t)
+			dev->_tempDue[i] = t + dev->PeriodN[i].value;
+
+		if (!dev->device.getTemperature(i, &sample))
+			continue;
+
+		/* nothing converted yet, or we've seen this one already */
+		if (sample.seq == 0 || sample.count == 0 || sample.seq == dev->_tempSeq[i])
+			continue;
+
+		dev->_tempSeq[i] = sample.seq;
+		dev->_temp[i] = sample.temp;
+		dev->TempN[dev->_tempMember[i]].value = st_celsius(sample.temp);
+		dev->TempTimeN[dev->_tempMember[i]].value = sample.when;
+		dev->_pollFresh++;
+
+		if (dev->StreamS[0].s == ISS_ON && blockAdd(&dev->_stream, i, sample)) {
+			dev->rmTimer(dev->_timerStream);
+			flushStream(dev);
+		}
+	}
+	dev->_pollNext = 0;
+
+	if (dev->_pollFresh) {
+		double temp[4], when[4];
+
+		/* while streaming the numbers are for ordinary clients only */
+		if (dev->StreamS[0].s != ISS_ON || t - dev->_lastDisplay >= dev->StreamN[1].value) {
+			dev->_lastDisplay = t;
+			setNumber(&dev->TempNP);
+			setNumber(&dev->TempTimeNP);
+		}
+
+		for (i = 0; i < 4; i++) {
+			temp[i] = dev->_tempSeq[i] ? st_celsius(dev->_temp[i]) : NAN;
+			when[i] = dev->_tempSeq[i] ? dev->TempTimeN[dev->_tempMember[i]].value : 0;
+		}
+		dev->shm.publishTemps(temp, when);
+		dev->_pollFresh = 0;
+
+		if (dev->_startPending) {
+			dev->_startPending = false;
+			dev->StartN[1].value = dev->mono() - dev->_startMark;
+			dev->StartNP.s = IPS_OK;
+			setNumber(&dev->StartNP, "First temperatures %.3f s after start, connected after %.3f s",
+				    dev->StartN[1].value, dev->StartN[0].value);
+		}
+	}
+
+	if (dev->_heaterDue <= t) {
+		dev->_heaterDue = t + ST_HEATER_POLL_INTERVAL / 1000.0;
+		dev->pollHeaters();
+	}
+
+	dev->schedulePoll();
+}
+
+/* A watchdog reset re-enumerates the board, so the old handle is dead
+   and every transfer fails with LIBUSB_ERROR_NO_DEVICE. The echo is the
+   cheapest way to find out between the slow polls. */
+void ScopeTemp::heartbeat(ScopeTemp *dev)
+{
+	ScopeTempSpan span("heartbeat", "timer");
+
+	dev->_timerBeat = dev->addTimer(ST_HEARTBEAT_INTERVAL, heartbeat);
+
+	if (dev->quiet() || dev->edgeWait())
+		return;
+
+	if (dev->device.isOpen()) {
+		if (dev->device.echo(0x5354, dev->_beats++))
+			return;
+		if (dev->device.lastError() != LIBUSB_ERROR_NO_DEVICE)
+			return;
+	}
+
+	dev->recover();
+}
+
+/* The board is there again. It may have been reset, or only dropped off
+   the bus for a moment: the boot counter tells, when it has one. */
+bool ScopeTemp::recover()
+{
+	ScopeTempDevice::status st;
+	int version = device.version(), caps = device.caps();
+
+	device.close();
+	if (!device.open(_state.path)) {
+		if (!_lost)
+			IDMessage(getDeviceName(), "%s is gone, looking for it every %d ms", ST_DEVICE, ST_HEARTBEAT_INTERVAL);
+		_lost = true;
+		return false;
+	}
+	_lost = false;
+	_reconnects++;
+
+	if (device.version() != version || device.caps() != caps)
+		updateCaps();
+
+	if (!device.hasCap(THERMAL_CAP_STATUS) || !device.getStatus(&st)) {
+		_statusValid = false;
+		IDMessage(getDeviceName(), "%s is back, can't tell if it was reset, restoring outputs", ST_DEVICE);
+		restoreOutputs();
+	} else if (!_statusValid || !device.hasCap(THERMAL_CAP_WATCHDOG)) {
+		/* the next poll starts the counters over */
+		_statusValid = false;
+		setPresent(st.present);
+		IDMessage(getDeviceName(), "%s is back, can't tell if it was reset, restoring outputs", ST_DEVICE);
+		restoreOutputs();
+	} else if (st.boots != _status.boots) {
+		addStatus(&st, true);
+		resync(&st);
+	} else {
+		/* outputs and pulses in flight are as we left them */
+		addStatus(&st, false);
+		IDMessage(getDeviceName(), "%s is back, boot %u, not reset", ST_DEVICE, st.boots);
+	}
+
+	return true;
+}
+
+/* reflashed while it was away, the properties follow the caps */
+void ScopeTemp::updateCaps()
+{
+	IDMessage(getDeviceName(), "Board is now protocol version %d, caps 0x%04x", device.version(), device.caps());
+
+	deleteProperty(HeaterSP.name);
+	deleteProperty(HeaterNP[0].name);
+	deleteProperty(HeaterStatusNP[0].name);
+	deleteProperty(HeaterNP[1].name);
+	deleteProperty(HeaterStatusNP[1].name);
+	deleteProperty(DiagNP.name);
+
+	if (device.hasCap(THERMAL_CAP_HEATER)) {
+		defineSwitch(&HeaterSP);
+		defineNumber(&HeaterNP[0]);
+		defineNumber(&HeaterStatusNP[0]);
+		defineNumber(&HeaterNP[1]);
+		defineNumber(&HeaterStatusNP[1]);
+	}
+
+	_statusValid = false;
+	if (device.hasCap(THERMAL_CAP_STATUS)) {
+		defineNumber(&DiagNP);
+		if (!_timerStatus)
+			_timerStatus = addTimer(ST_STATUS_POLL_INTERVAL, pollStatus);
+	} else if (_timerStatus) {
+		rmTimer(_timerStatus);
+		_timerStatus = 0;
+	}
+
+	if (!device.hasCap(THERMAL_CAP_PRESENCE))
+		setPresent(0x0F);
+}
+
+/* After a reset the counters start over, the outputs are off and any
+   pulse being timed is lost. */
+void ScopeTemp::resync(const ScopeTempDevice::status *st)
+{
+	static const char *causes[4] = { "power-on", "external", "brown-out", "watchdog" };
+	char cause[48] = "";
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		if (!(st->reset_cause & (1 << i)))
+			continue;
+		if (cause[0])
+			strcat(cause, ", ");
+		strcat(cause, causes[i]);
+	}
+	IDMessage(getDeviceName(), "Board reset (%s), boot %u, restoring outputs",
+		  cause[0] ? cause : "unknown", st->boots);
+
+	_resets++;
+	memset(_tempSeq, 0, sizeof(_tempSeq));
+
+	restoreOutputs();
+}
+
+/* manual moves, PWM duties and the heater loops go back as they were */
+void ScopeTemp::restoreOutputs()
+{
+	guide(GUIDE_AXIS_DEC, 0, 0);
+	guide(GUIDE_AXIS_RA, 0, 0);
+	setGuiding((MoveS[GUIDE_AXIS_DEC][0].s == ISS_ON), (MoveS[GUIDE_AXIS_DEC][1].s == ISS_ON),
+		   (MoveS[GUIDE_AXIS_RA][0].s == ISS_ON), (MoveS[GUIDE_AXIS_RA][1].s == ISS_ON));
+
+	queueOutputs(ST_PENDING_PWM | (device.hasCap(THERMAL_CAP_HEATER) ? ST_PENDING_HEATER | (ST_PENDING_HEATER << 1) : 0));
+}
+
+/* The device counters are free running and narrow, accumulate the
+   deltas. After a reset they started over from zero. */
+void ScopeTemp::addStatus(const ScopeTempDevice::status *st, bool reset)
+{
+	ScopeTempDevice::status zero;
+	const ScopeTempDevice::status *prev = &_status;
+	int i;
+
+	DiagN[0].value = st->loops;
+	DiagN[1].value = st->max_gap;
+	DiagN[11].value = st->boots;
+	DiagN[12].value = st->reset_cause;
+
+	if (!_statusValid) {
+		DiagN[2].value = st->conversions;
+		for (i = 0; i < 4; i++) {
+			DiagN[3 + i].value = st->reset_err[i];
+			DiagN[7 + i].value = st->crc_err[i];
+		}
+	} else {
+		if (reset) {
+			memset(&zero, 0, sizeof(zero));
+			prev = &zero;
+		}
+		DiagN[2].value += (uint16_t) (st->conversions - prev->conversions);
+		for (i = 0; i < 4; i++) {
+			DiagN[3 + i].value += (uint8_t) (st->reset_err[i] - prev->reset_err[i]);
+			DiagN[7 + i].value += (uint8_t) (st->crc_err[i] - prev->crc_err[i]);
+		}
+	}
+
+	_status = *st;
+	_statusValid = true;
+	setPresent(st->present);
+}
+
+void ScopeTemp::pollStatus(ScopeTemp *dev)
+{
+	ScopeTempDevice::status st;
+	bool reset;
+	ScopeTempSpan span("pollStatus", "timer");
+
+	if (dev->quiet()) {
+		dev->_timerStatus = dev->addTimer(ST_QUIET_RETRY, pollStatus);
+		return;
+	}
+
+	if (dev->guardEdge(pollStatus, &dev->_timerStatus))
+		return;
+
+	if (dev->device.getStatus(&st)) {
+		reset = dev->_statusValid && st.boots != dev->_status.boots;
+		dev->addStatus(&st, reset);
+		if (reset)
+			dev->resync(&st);
+		dev->DiagNP.s = IPS_OK;
+	} else {
+		dev->DiagNP.s = IPS_ALERT;
+	}
+	setNumber(&dev->DiagNP);
+	setNumber(&dev->LatencyNP);
+	dev->updateJitter();
+
+	dev->_timerStatus = dev->addTimer(ST_STATUS_POLL_INTERVAL, pollStatus);
+}
+
+static void appendf(std::string &out, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static void appendf(std::string &out, const char *fmt, ...)
+{
+	char buf[256];
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+
+	out += buf;
+}
+
+void ScopeTemp::renderMetrics(std::string &out, void *p)
+{
+	ScopeTempSpan span("metrics", "metrics");
+
+	((ScopeTemp *) p)->metrics(out);
+}
+
+/* What the properties already hold, plus the counters nothing else
+   shows. Cheap enough to render on every scrape: no transfers, nothing
+   but the last values seen. */
+void ScopeTemp::metrics(std::string &out)
+{
+	static const char *dirs[2][2] = { { "N", "S" }, { "W", "E" } };
+	const ScopeTempDevice::stats &st = device.getStats();
+	int i, j, rq;
+
+	out.clear();
+
+	appendf(out, "# HELP scopetemp_connected Whether the board is open.\n");
+	appendf(out, "# TYPE scopetemp_connected gauge\n");
+	appendf(out, "scopetemp_connected %d\n", isConnected() && device.isOpen());
+
+	appendf(out, "# HELP scopetemp_sensor_present Whether a sensor answers.\n");
+	appendf(out, "# TYPE scopetemp_sensor_present gauge\n");
+	for (i = 0; i < 4; i++)
+		appendf(out, "scopetemp_sensor_present{sensor=\"T%d\"} %d\n", i + 1, (_present >> i) & 1);
+
+	appendf(out, "# HELP scopetemp_temperature_celsius Last reading.\n");
+	appendf(out, "# TYPE scopetemp_temperature_celsius gauge\n");
+	for (i = 0; i < 4; i++)
+		if (_tempMember[i] >= 0 && TempTimeN[_tempMember[i]].value)
+			appendf(out, "scopetemp_temperature_celsius{sensor=\"T%d\"} %.4f\n", i + 1, st_celsius(_temp[i]));
+
+	appendf(out, "# HELP scopetemp_temperature_timestamp_seconds When the last reading was converted.\n");
+	appendf(out, "# TYPE scopetemp_temperature_timestamp_seconds gauge\n");
+	for (i = 0; i < 4; i++)
+		if (_tempMember[i] >= 0 && TempTimeN[_tempMember[i]].value)
+			appendf(out, "scopetemp_temperature_timestamp_seconds{sensor=\"T%d\"} %.3f\n", i + 1, TempTimeN[_tempMember[i]].value);
+
+	appendf(out, "# HELP scopetemp_pwm_ratio PWM duty.\n");
+	appendf(out, "# TYPE scopetemp_pwm_ratio gauge\n");
+	for (i = 0; i < 2; i++)
+		appendf(out, "scopetemp_pwm_ratio{output=\"PWM%d\"} %.4f\n", i + 1, PWMN[i].value / 100.0);
+
+	if (device.hasCap(THERMAL_CAP_HEATER)) {
+		appendf(out, "# HELP scopetemp_heater_output_ratio Heater loop output.\n");
+		appendf(out, "# TYPE scopetemp_heater_output_ratio gauge\n");
+		for (i = 0; i < 2; i++)
+			appendf(out, "scopetemp_heater_output_ratio{output=\"PWM%d\",auto=\"%d\"} %.4f\n", i + 1,
+				HeaterS[i].s == ISS_ON, HeaterStatusN[i][2].value / 100.0);
+	}
+
+	appendf(out, "# HELP scopetemp_guide_pulses_total Timed guide pulses started.\n");
+	appendf(out, "# TYPE scopetemp_guide_pulses_total counter\n");
+	for (i = 0; i < 2; i++)
+		for (j = 0; j < 2; j++)
+			appendf(out, "scopetemp_guide_pulses_total{direction=\"%s\"} %lu\n", dirs[i][j], _pulses[i][j]);
+
+	appendf(out, "# HELP scopetemp_guide_pulse_seconds_total Timed guide pulses, as asked for.\n");
+	appendf(out, "# TYPE scopetemp_guide_pulse_seconds_total counter\n");
+	for (i = 0; i < 2; i++)
+		for (j = 0; j < 2; j++)
+			appendf(out, "scopetemp_guide_pulse_seconds_total{direction=\"%s\"} %.3f\n", dirs[i][j], _pulseTime[i][j]);
+
+	appendf(out, "# HELP scopetemp_guide_edge_late_p99_seconds Host timed stop edges, 99th percentile lateness.\n");
+	appendf(out, "# TYPE scopetemp_guide_edge_late_p99_seconds gauge\n");
+	appendf(out, "scopetemp_guide_edge_late_p99_seconds %.6f\n", JitterN[2].value / 1000.0);
+
+	appendf(out, "# HELP scopetemp_usb_transfer_duration_seconds Control transfers, by request.\n");
+	appendf(out, "# TYPE scopetemp_usb_transfer_duration_seconds histogram\n");
+	for (rq = 0; rq < 16; rq++) {
+		const char *name = st_request_name(rq);
+		unsigned long n = 0;
+
+		if (!st.count[rq])
+			continue;
+
+		for (i = 0; i < ScopeTempDevice::ST_LATENCY_BUCKETS; i++) {
+			n += st.bucket[rq][i];
+			appendf(out, "scopetemp_usb_transfer_duration_seconds_bucket{request=\"%s\",le=\"%g\"} %lu\n",
+				name, ScopeTempDevice::latencyBound(i), n);
+		}
+		appendf(out, "scopetemp_usb_transfer_duration_seconds_bucket{request=\"%s\",le=\"+Inf\"} %lu\n", name, st.count[rq]);
+		appendf(out, "scopetemp_usb_transfer_duration_seconds_sum{request=\"%s\"} %.6f\n", name, st.sum[rq]);
+		appendf(out, "scopetemp_usb_transfer_duration_seconds_count{request=\"%s\"} %lu\n", name, st.count[rq]);
+	}
+
+	appendf(out, "# HELP scopetemp_usb_errors_total Control transfers that failed, by request.\n");
+	appendf(out, "# TYPE scopetemp_usb_errors_total counter\n");
+	for (rq = 0; rq < 16; rq++)
+		if (st.count[rq])
+			appendf(out, "scopetemp_usb_errors_total{request=\"%s\"} %lu\n", st_request_name(rq), st.errors[rq]);
+
+	appendf(out, "# HELP scopetemp_reconnects_total Times the board was opened again after going away.\n");
+	appendf(out, "# TYPE scopetemp_reconnects_total counter\n");
+	appendf(out, "scopetemp_reconnects_total %lu\n", _reconnects);
+
+	appendf(out, "# HELP scopetemp_board_resets_total Board resets seen and recovered from.\n");
+	appendf(out, "# TYPE scopetemp_board_resets_total counter\n");
+	appendf(out, "scopetemp_board_resets_total %lu\n", _resets);
+
+	if (_statusValid) {
+		appendf(out, "# HELP scopetemp_board_loop_hertz Firmware main loop rate.\n");
+		appendf(out, "# TYPE scopetemp_board_loop_hertz gauge\n");
+		appendf(out, "scopetemp_board_loop_hertz %.0f\n", DiagN[0].value);
+
+		appendf(out, "# HELP scopetemp_board_poll_gap_max_seconds Longest usbPoll gap on the board.\n");
+		appendf(out, "# TYPE scopetemp_board_poll_gap_max_seconds gauge\n");
+		appendf(out, "scopetemp_board_poll_gap_max_seconds %.5f\n", DiagN[1].value / 1000.0);
+	}
 }
@@ -1,38 +1,38 @@
 #ifndef __SCOPETEMP_H
 #define __SCOPETEMP_H
 
-#include <libusb-1.0/libusb.h>
-
 #include <indidevapi.h>
 #include <defaultdevice.h>
 
-
-#define ST_MANUFACTURER "mconovici@gmail.com"
-#define ST_PRODUCT "ScopeTemp"
+#include "libscopetemp.h"
+#include "scopetemp-shm.h"
+#include "scopetemp-record.h"
+#include "scopetemp-metrics.h"
 
 #define ST_DEVICE ST_PRODUCT
 
 class ScopeTemp : public INDI::DefaultDevice {
 
-	static const int ST_READ  = 0xC0;
-	static const int ST_WRITE = 0x40;
+	static const int ST_TEMP_POLL_INTERVAL = 10000; // milisec, default per sensor
+	static const int ST_HEATER_POLL_INTERVAL = 10000; // milisec
+	static const int ST_STATUS_POLL_INTERVAL = 60000; // milisec
+	static const int ST_HEARTBEAT_INTERVAL = 1000; // milisec
+
+	static const int ST_QUIET_RETRY = 500;    // milisec
+	static const int ST_QUIET_LEAD = 1;       // sec before exposure end
+	static const int ST_QUIET_MAX = 60;       // sec
 
-	static const int ST_REQUEST_TEMP  = 1;
-	static const int ST_REQUEST_GUIDE = 2;
-	static const int ST_REQUEST_PWM   = 3;
+	static const int ST_GUARD_SLACK = 2;      // milisec after a guide edge
 
-	static const int ST_TEMP_POLL_INTERVAL = 10000; // milisec
+	static const int ST_CAL_ROUNDS = 32;
+
+	static const int ST_JITTER_SAMPLES = 1024;
 
 public:
 
 	ScopeTemp();
 	~ScopeTemp();
 
-	bool getTemperature(int id, double *temp);
-	bool setPWM(int pwm1, int pwm2);
-	bool setGuiding(int n, int s, int w, int e);
-
-
 	bool Connect();
 	bool Disconnect();
 
@@ -40,43 +40,284 @@ public:
 
 	bool ISNewNumber(const char *dev, const char *name, double values[], char *names[], int n);
 	bool ISNewSwitch(const char *dev, const char *name, ISState *states, char *names[], int n);
+	bool ISNewText(const char *dev, const char *name, char *texts[], char *names[], int n);
+	bool ISSnoopDevice(XMLEle *root);
 
 	bool initProperties();
 	bool updateProperties();
 
+	/* run on clock against transport instead of INDI's timers and the
+	   USB board, no shared memory or state file. Before connecting. */
+	void simulate(ScopeTempClock *clock, ScopeTempTransport *transport);
+
+	/* everything worth a graph, Prometheus text exposition */
+	void metrics(std::string &out);
+
 private:
-	libusb_device_handle *usb_handle;
+	/* all time and timers go through here */
+	ScopeTempClock *_clock;
+	bool _sim;
 
-	int _timerNS;
-	int _timerEW;
-	int _guideN, _guideS, _guideE, _guideW;
+	double mono() { return _clock->mono(); }
+	int addTimer(int ms, void (*cb)(ScopeTemp *)) { return _clock->addTimer(ms, (void (*)(void *)) cb, this); }
+	void rmTimer(int id) { _clock->rmTimer(id); }
 
-	static void stop_NS(ScopeTemp *dev);
-	bool guide_NS(double duration, int dir);
+	/* ISNewNumber, ISNewSwitch routing */
+	typedef bool (ScopeTemp::*NumberHandler)(int arg, double values[], char *names[], int n);
+	typedef bool (ScopeTemp::*SwitchHandler)(int arg, ISState *states, char *names[], int n);
+
+	static const int ST_HANDLERS = 64; // power of 2, at least twice the properties
+
+	struct handler {
+		const char *name;
+		NumberHandler number;
+		SwitchHandler sw;
+		int arg;
+	};
+
+	struct handler _handlers[ST_HANDLERS];
+	void addHandler(const char *name, NumberHandler number, SwitchHandler sw, int arg);
+	void addNumber(INumberVectorProperty *nvp, NumberHandler h, int arg = 0);
+	void addSwitch(ISwitchVectorProperty *svp, SwitchHandler h, int arg = 0);
+	const handler *findHandler(const char *dev, const char *name);
+
+	bool newPWM(int, double values[], char *names[], int n);
+	bool newRtPriority(int, double values[], char *names[], int n);
+	bool newPeriod(int, double values[], char *names[], int n);
+	bool newBurst(int, double values[], char *names[], int n);
+	bool newStreamSettings(int, double values[], char *names[], int n);
+	bool newGuard(int, double values[], char *names[], int n);
+	bool newHeaterSettings(int ch, double values[], char *names[], int n);
+	bool newTimedGuide(int axis, double values[], char *names[], int n);
+
+	bool newHeaterAuto(int, ISState *states, char *names[], int n);
+	bool newRealtime(int, ISState *states, char *names[], int n);
+	bool newStream(int, ISState *states, char *names[], int n);
+	bool newCompensation(int, ISState *states, char *names[], int n);
+	bool newEventTrace(int, ISState *states, char *names[], int n);
+	bool newMotion(int axis, ISState *states, char *names[], int n);
+
+	ScopeTempDevice device;
+	ScopeTempShm shm;
+
+	/* control transfers to a trace file while there's a name in here */
+	ScopeTempRecorder _record;
+	bool setTrace(const char *file);
 
+	IText TraceT[1];
+	ITextVectorProperty TraceTP;
+
+	/* spans, see scopetemp-spans.h */
+	ISwitch SpanS[2];
+	ISwitchVectorProperty SpanSP;
+
+	IText SpanDumpT[1];
+	ITextVectorProperty SpanDumpTP;
+
+	/* metrics socket, up from start whether connected or not */
+	ScopeTempMetrics _metrics;
+	static void renderMetrics(std::string &out, void *p);
+
+	IText MetricsT[1];
+	ITextVectorProperty MetricsTP;
+
+	/* since start, for the metrics */
+	unsigned long _pulses[2][2];
+	double _pulseTime[2][2];	// s
+	unsigned long _reconnects, _resets;
+
+	bool setGuiding(int n, int s, int w, int e);
+
+	/* per axis, GUIDE_AXIS_DEC (N, S) and GUIDE_AXIS_RA (W, E) */
+	int _timerGuide[2];
+	int _guide[2][2];
+
+	static void stop_NS(ScopeTemp *dev);
 	static void stop_EW(ScopeTemp *dev);
-	bool guide_EW(double duration, int dir);
+	void stopGuide(int axis);
+	bool guide(int axis, double duration, int dir);
+	bool pushGuide();
+
+	/* pending timed guide edges, monotonic seconds, 0 = none */
+	double _edge[2];
+	int edgeWait();
+	bool guardEdge(void (*cb)(ScopeTemp *), int *timer);
+
+	INumber GuardN[1];
+	INumberVectorProperty GuardNP;
+
+	void calibrateLatency();
+	void timerLate(double late);
+	double guideDelay(double duration);
+
+	INumber LatencyN[5];
+	INumberVectorProperty LatencyNP;
+
+	ISwitch CompS[2];
+	ISwitchVectorProperty CompSP;
+
+	/* stop timer lateness, ms, ring */
+	double _jitter[ST_JITTER_SAMPLES];
+	double _jitterSorted[ST_JITTER_SAMPLES];
+	int _jitterCount;
+	void updateJitter();
+
+	INumber JitterN[4];
+	INumberVectorProperty JitterNP;
+
+	bool setRealtime(bool on);
+
+	ISwitch RtS[2];
+	ISwitchVectorProperty RtSP;
+
+	INumber RtPrioN[1];
+	INumberVectorProperty RtPrioNP;
 
 	int _timerTemp;
 	static void pollTemperature(ScopeTemp *dev);
 
+	uint8_t _tempSeq[4];
+	int _pollNext, _pollFresh;
+
+	/* next read per sensor, monotonic seconds */
+	double _tempDue[4], _heaterDue;
+	void schedulePoll();
+
+	INumber PeriodN[4];
+	INumberVectorProperty PeriodNP;
+
+	/* stream and burst samples go out in binary blocks */
+	static const int ST_BLOCK_RECORDS = 4096;
+
+	struct block {
+		struct st_block_header header;
+		struct st_block_record record[ST_BLOCK_RECORDS];
+	} __attribute__((packed));
+
+	static bool blockAdd(struct block *b, int id, const ScopeTempDevice::sample &sample);
+	void blockSend(struct block *b, IBLOB *blob, IBLOBVectorProperty *bvp);
+
+	struct block _stream;
+	int _timerStream;
+	double _lastDisplay;
+	static void flushStream(ScopeTemp *dev);
+
+	ISwitch StreamS[2];
+	ISwitchVectorProperty StreamSP;
+
+	INumber StreamN[2];
+	INumberVectorProperty StreamNP;
+
+	IBLOB StreamB[1];
+	IBLOBVectorProperty StreamBP;
+
+	/* burst capture, polling as fast as the conversions come and
+	   nothing else while it lasts */
+	static const int ST_BURST_INTERVAL = 50;
+
+	struct block _burst;
+	int _timerBurst;
+	double _burstEnd;
+	static void pollBurst(ScopeTemp *dev);
+	void endBurst();
+
+	INumber BurstN[1];
+	INumberVectorProperty BurstNP;
+
+	IBLOB BurstB[1];
+	IBLOBVectorProperty BurstBP;
+
+	/* warm start snapshot, in ~/.indi next to the INDI config */
+	struct {
+		char path[32];
+		char serial[32];
+		double pwm[2];
+		int present;
+		double latency[4];	// ECHO_RTT .. WRITE_MAD, 0 if never calibrated
+		int heater[2];		// HeaterS on, -1 if never saved
+		double loop[2][5];	// HeaterN, sensor .. Ki
+	} _state;
+	void loadState();
+	void saveState();
+
+	/* start to first sample, from process start, or Connect() later */
+	double _startMark;
+	bool _startPending;
+
+	INumber StartN[2];
+	INumberVectorProperty StartNP;
+
+	/* PWM and heater changes, sent clear of the guide edges */
+	static const int ST_PENDING_PWM = 0x01;
+	static const int ST_PENDING_HEATER = 0x02;	// << channel
+	static const int ST_PENDING_AUTO = 0x08;	// HeaterSP waits for the lot
+
+	int _pending;
+	int _timerOutputs;
+	bool queueOutputs(int what);
+	static void flushOutputs(ScopeTemp *dev);
+
+	/* TEMPERATURE and TEMPERATURE_TIME only carry the sensors that are
+	   present, _tempMember[] is where sensor n is, -1 if absent */
+	uint8_t _present;
+	int _tempMember[4];
+	int16_t _temp[4];	// 1/16 C, last sample per sensor, TempN only shows it
+	void setPresent(uint8_t present);
+
 	INumber TempN[4];
 	INumberVectorProperty TempNP;
 
+	INumber TempTimeN[4];
+	INumberVectorProperty TempTimeNP;
+
+	bool _ccdReadout;
+	double _ccdReadoutSince;
+	bool quiet();
+
+	IText SnoopT[1];
+	ITextVectorProperty SnoopTP;
+
+	int _timerStatus;
+	static void pollStatus(ScopeTemp *dev);
+
+	ScopeTempDevice::status _status;
+	bool _statusValid;
+
+	/* a board that went away gets reopened, one that reset gets its
+	   outputs back */
+	int _timerBeat;
+	uint16_t _beats;
+	bool _lost;
+	static void heartbeat(ScopeTemp *dev);
+	bool recover();
+	void resync(const ScopeTempDevice::status *st);
+	void restoreOutputs();
+	void updateCaps();
+	void addStatus(const ScopeTempDevice::status *st, bool reset);
+
+	INumber DiagN[13];
+	INumberVectorProperty DiagNP;
+
 	INumber PWMN[2];
 	INumberVectorProperty PWMNP;
 
-	ISwitch MoveNSS[2];
-	ISwitchVectorProperty MoveNSSP;
+	bool pushHeater(int ch);
+	void pollHeaters();
+
+	ISwitch HeaterS[2];
+	ISwitchVectorProperty HeaterSP;
+
+	INumber HeaterN[2][5];
+	INumberVectorProperty HeaterNP[2];
 
-	ISwitch MoveEWS[2];
-	ISwitchVectorProperty MoveEWSP;
+	INumber HeaterStatusN[2][3];
+	INumberVectorProperty HeaterStatusNP[2];
 
-	INumber TimedMoveNSN[2];
-	INumberVectorProperty TimedMoveNSNP;
+	ISwitch MoveS[2][2];
+	ISwitchVectorProperty MoveSP[2];
 
-	INumber TimedMoveEWN[2];
-	INumberVectorProperty TimedMoveEWNP;
+	INumber TimedMoveN[2][2];
+	INumberVectorProperty TimedMoveNP[2];
 };
 
 #endif